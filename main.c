@@ -1,15 +1,23 @@
-// So VS Code can find "CLOCK_PROCESS_CPUTIME_ID", and so we can use strdup()
+// So VS Code can find "CLOCK_PROCESS_CPUTIME_ID"
 #define _POSIX_C_SOURCE 200809L
 
 #include "box2d/box2d.h"
 #include "grug.h"
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -17,16 +25,66 @@
 #define SCREEN_HEIGHT 720
 #define TEXTURE_SCALE 2.0f
 #define PIXELS_PER_METER 20.0f // Taken from Cortex Command, where this program's sprites come from: https://github.com/cortex-command-community/Cortex-Command-Community-Project/blob/afddaa81b6d71010db299842d5594326d980b2cc/Source/System/Constants.h#L23
-#define MAX_ENTITIES 1000 // Prevents box2d crashing when there's more than 32k overlapping entities, which can happen when the game is paused and the player shoots over 32k bullets
+#define DEFAULT_MAX_ENTITIES 1000 // Prevents box2d crashing when there's more than 32k overlapping entities, which can happen when the game is paused and the player shoots over 32k bullets
+#define KILL_ZONE_Y (-SCREEN_HEIGHT / 2.0f / TEXTURE_SCALE - 100.0f) // Entities that fall below this get despawned
+#define INITIAL_DESPAWN_QUEUE_CAPACITY 64
+#define INITIAL_SPAWN_COMMANDS_CAPACITY 64
+#define MAX_BULLET_POOLS 420
+#define MAX_TICK_GROUPS 420
+#define INITIAL_TICK_GROUP_CAPACITY 64
+#define INITIAL_TICK_COMMANDS_CAPACITY 64
+#define RESERVED_SLOTS_PER_TICK_RANGE 64 // How many entities every range of a parallel tick can spawn
+#define INITIAL_BULLET_POOL_CAPACITY 64
+#define BULLET_POOL_TRIM_TICKS (5 * TICKS_PER_SECOND) // Parked bullets that stay unused for this long get destroyed
+#define MAX_GLOBALS_SLABS 420
+#define MAX_DLL_ENTITIES 420
+#define INITIAL_ENTITY_LIST_CAPACITY 16
+#define GLOBALS_ALIGNMENT 64 // A cache line, so no two entities' globals share one
+#define GLOBALS_PER_CHUNK 64
+#define INITIAL_GLOBALS_CHUNKS_CAPACITY 8
+#define CULLING_MARGIN (2.0f * PIXELS_PER_METER) // Covers how far an interpolated sprite can lag behind its shape's AABB
 #define FONT_SIZE 10
-#define MAX_MEASUREMENTS 420
-#define MAX_TYPE_FILES 420420
+#define MAX_FRAME_ZONES 128
+#define MAX_ZONE_DEPTH 16
+#define PROFILED_FRAMES 1024 // Enough history for the p99 to catch one-in-a-thousand hitches
+#define PROFILER_STATS_INTERVAL 30 // In frames, which keeps the overlay's numbers from flickering
+#define MAX_ZONE_STATS 64
+#define ZONE_HISTOGRAM_BUCKETS 128
+#define ZONE_HISTOGRAM_BUCKETS_PER_DOUBLING 6 // Makes every bucket 12% wider than the one before it, which is how precise the overlay's percentiles are
+#define MAX_MOD_COSTS 420
+#define SHOWN_MOD_COSTS 5 // How many of the most expensive mods the overlay lists
+#define MAX_ENTITY_TYPES 420
+#define INITIAL_TYPE_FILES_CAPACITY 16
 #define MAX_MESSAGES 10
 #define MAX_MESSAGE_LENGTH 420420
+#define MAX_TICK_MESSAGE_LENGTH 4200 // Longer messages from a parallel on_tick() get truncated
 #define ERROR_MESSAGE_DURATION_MS 5000
 #define ERROR_MESSAGE_FADING_MOMENT_MS 4000
 #define NANOSECONDS_PER_SECOND 1000000000L
 #define MAX_I32_MAP_ENTRIES 420
+#define INITIAL_I32_MAP_CAPACITY 8
+#define INITIAL_INTERNED_STRINGS_CAPACITY 64
+#define SPAWNED_BOX_COUNT 160
+#define TICKS_PER_SECOND 60
+#define SECONDS_PER_TICK (1.0f / TICKS_PER_SECOND)
+#define SUBSTEP_COUNT 4
+#define MAX_TICKS_PER_FRAME 5 // Prevents the spiral of death, where catching up on ticks takes so long that even more ticks are needed
+#define MAX_FRAME_SECONDS 0.25f // Prevents a single hitch, like dragging the window, from queueing a huge number of ticks
+#define MAX_WORKERS 64
+#define MAX_WATCHED_DIRS 4200
+#define TEXTURE_DECODER_COUNT 2
+#define INITIAL_DECODE_JOBS_CAPACITY 16
+#define FIRST_DECODE_RETRY_MS 10 // Doubled on every failed attempt, since a PNG that is still being written fails to decode
+#define MAX_DECODE_RETRY_MS 1000
+#define MAX_DECODE_ATTEMPTS 30 // Gives up on a broken PNG after roughly half a minute
+#define TEXTURE_UPLOAD_BUDGET_MS 2.0 // Textures that don't fit in a frame's budget are uploaded in the next frame
+#define MOD_WATCH_QUIET_MS 100 // How long the mods have to stay untouched after a change before they're regenerated
+#define MAX_TASKS 420
+#define MAX_WORKER_CHUNKS 420
+#define INITIAL_ENTITIES_CAPACITY 64
+#define MAX_TEXTURES 420
+#define MAX_SOUNDS 420
+#define VOICES_PER_SOUND 8
 
 typedef int32_t i32;
 typedef uint32_t u32;
@@ -45,43 +103,88 @@ struct gun_data {
 
 struct bullet_data {
 	float density;
+
+	// Set by create_entity() when it handed this bullet a parked body,
+	// which apply_spawn_commands() then reenables instead of creating a new body
+	bool has_parked_body;
+	u32 parked_texture;
+	float parked_density;
+
+	// The size the parked shape was built with, which is stale if the texture got reloaded with another size
+	int parked_width;
+	int parked_height;
 };
 
 struct box_data {
+	// Interned, since the string that the mod passed dangles once its .so is reloaded
 	char *sprite_path;
 };
 
-struct i32_map {
-	char *keys[MAX_I32_MAP_ENTRIES];
-	i32 values[MAX_I32_MAP_ENTRIES];
+struct i32_map_entry {
+	// Interned, so it's compared by address
+	// NULL means that the entry is empty
+	char *key;
+
+	i32 value;
+};
 
-	u32 buckets[MAX_I32_MAP_ENTRIES];
-	u32 chains[MAX_I32_MAP_ENTRIES];
+// An open addressing hash map with linear probing
+// Most entities never use their map, so the entries are only allocated on the first write
+struct i32_map {
+	// The capacity is always a power of 2, and at least twice the size
+	struct i32_map_entry *entries;
+	size_t capacity;
 
 	size_t size;
 };
 
+// The fields that drawing, ticking and stepping read every frame
+// The rarely used fields live in struct entity_cold, so these loops don't drag them into the cache
 struct entity {
 	u64 id;
 	enum entity_type type;
 	b2BodyId body_id;
-	b2ShapeId shape_id;
-	Texture texture;
 
-	// This has ownership, because grug_resource_reloads[] contains texture paths
-	// that start dangling the moment the .so is unloaded
-	// There is no way for `streq(entity->texture_path, reload.path)` to work without ownership
-	char *texture_path;
+	// The body's transform before and after the last tick, for interpolating between them while drawing
+	b2Transform previous_transform;
+	b2Transform transform;
 
-	void *dll;
+	// Index into textures[], or UINT32_MAX if the entity doesn't have a texture
+	u32 texture;
 
 	void *on_fns;
 	void *globals;
 
 	bool flippable;
+};
+
+// The fields that are only used when spawning, despawning, reloading, or calling game functions
+// entity_colds[i] belongs to entities[i]
+struct entity_cold {
+	b2ShapeId shape_id;
+
+	void *dll;
+
+	// Where the globals were allocated from
+	struct globals_slab *globals_slab;
+
 	bool enable_hit_events;
 
-	struct i32_map *i32_map;
+	// Stops an entity from being queued, and having its on_despawn() called, twice
+	bool despawn_queued;
+
+	// Where the entity is in tick_groups[], or UINT32_MAX if it doesn't have an on_tick()
+	u32 tick_group;
+	u32 tick_index;
+
+	// Index into mod_costs[]
+	u32 mod_cost;
+
+	// Where the entity is in the entity list of its .so and of its texture, or UINT32_MAX if it isn't in one
+	u32 dll_index;
+	u32 texture_index;
+
+	struct i32_map i32_map;
 
 	union {
 		struct gun_data gun;
@@ -112,23 +215,424 @@ struct counter_on_spawn_data {
 	char *name;
 };
 
-static struct entity entities[MAX_ENTITIES];
+// Both arrays grow as needed, so pointers into them are only valid until the next spawn
+static struct entity *entities;
+static struct entity_cold *entity_colds;
 static size_t entities_size;
+static size_t entities_capacity;
+
+// Can be changed at runtime, but spawning is refused once there are this many entities
+static size_t max_entities = DEFAULT_MAX_ENTITIES;
+
+// The IDs of the entities that left the world or that mods despawned,
+// which get despawned together by apply_commands()
+// IDs are used instead of indices, since on_despawn() can spawn and despawn entities
+static u64 *despawn_queue;
+static size_t despawn_queue_size;
+static size_t despawn_queue_capacity;
+
+// A spawn that a mod requested, whose on_spawn() and body creation are deferred to apply_commands()
+// The entity itself already exists, so the ID that the mod got back can be used right away
+struct spawn_command {
+	u64 id;
+
+	// Only used by bullets
+	float x;
+	float y;
+	float angle_in_degrees;
+	float velocity_in_meters_per_second;
+};
+
+static struct spawn_command *spawn_commands;
+static size_t spawn_commands_size;
+static size_t spawn_commands_capacity;
+
+// Hands out the globals of all entities of a single .so, which all have the same size
+// They are carved out of big chunks, so the entities of one mod sit together in memory,
+// and spawning and despawning only pushes and pops a free list
+struct globals_slab {
+	void *dll;
+
+	// globals_size rounded up to GLOBALS_ALIGNMENT
+	size_t stride;
+
+	char **chunks;
+	size_t chunks_size;
+	size_t chunks_capacity;
+
+	// How many blocks of the last chunk have been handed out
+	size_t used_in_last_chunk;
+
+	// Every free block starts with a pointer to the next free block
+	void *free_list;
+
+	// How many blocks are handed out
+	size_t live;
+
+	// Set once its .so got reloaded, after which the slab is destroyed as soon as its last block is freed
+	bool detached;
+};
+
+// Pointers, since entities point to their slab, and this array gets swap-removed from
+static struct globals_slab *globals_slabs[MAX_GLOBALS_SLABS];
+static size_t globals_slabs_size;
+
+// A despawned bullet whose disabled body, shape, globals and i32 map are kept around,
+// so that spawning the next bullet of the same file doesn't need to allocate anything
+struct parked_bullet {
+	b2BodyId body_id;
+	b2ShapeId shape_id;
+	void *globals;
+	struct globals_slab *globals_slab;
+	struct i32_map i32_map;
+
+	// Still acquired, so the texture doesn't get unloaded between shots
+	u32 texture;
+
+	float density;
+
+	// The texture's size when the bullet got parked, which its shape was built with
+	int width;
+	int height;
+};
+
+// There is one pool per bullet .so, since the size of the globals depends on it
+struct bullet_pool {
+	void *dll;
+	struct parked_bullet *parked;
+	size_t size;
+	size_t capacity;
+
+	// The fewest bullets that were parked since the last trim
+	// The pool is a stack, so these are the ones at its bottom, which nobody needed
+	size_t low_water_size;
+};
+
+static struct bullet_pool bullet_pools[MAX_BULLET_POOLS];
+static size_t bullet_pools_size;
+static size_t ticks_since_bullet_pool_trim;
+
+// The entities of a single .so that have an on_tick(),
+// so that ticking is a tight loop that keeps calling the same mod code
+// There is one group per .so, since every .so has a single entity type
+struct tick_group {
+	void *dll;
+	void (*tick)(void *globals);
+	u32 mod_cost;
+
+	// ids[i] belongs to globals[i], and is used to find the entity that gets moved into a removed one's place
+	void **globals;
+	u64 *ids;
+	size_t size;
+	size_t capacity;
+};
+
+static struct tick_group tick_groups[MAX_TICK_GROUPS];
+static size_t tick_groups_size;
+
+// The ids of the entities that share a .so or a texture,
+// so that hot reloading only has to visit the entities it affects
+struct entity_list {
+	u64 *ids;
+	size_t size;
+	size_t capacity;
+};
+
+struct dll_entities {
+	void *dll;
+	struct entity_list entities;
+};
+
+static struct dll_entities dll_entities[MAX_DLL_ENTITIES];
+static size_t dll_entities_size;
+
+// The time spent in the on_fns of the entities of one mod,
+// which includes the game functions that the on_fns called
+// Reloading a mod keeps adding to the same entry, since it's looked up by the entity name
+struct mod_cost {
+	// Interned
+	char *entity;
+	char *file_name;
+
+	// Index 0 is grug's fast mode, and index 1 is its safe mode
+	// Atomic, since parallel ticks add to them from every worker
+	atomic_llong calls[2];
+	atomic_llong ns[2];
+};
+
+static struct mod_cost mod_costs[MAX_MOD_COSTS];
+static size_t mod_costs_size;
+
+// Whether on_tick() gets called on all workers, which is only done when grug is in fast mode
+static bool parallel_ticks;
+
+enum tick_command_type {
+	TICK_COMMAND_SPAWN,
+	TICK_COMMAND_MAP_SET_I32,
+	TICK_COMMAND_PLAY_SOUND,
+	TICK_COMMAND_DESPAWN,
+	TICK_COMMAND_MESSAGE,
+};
+
+struct tick_spawn {
+	u32 slot_index;
+	enum entity_type type;
+	struct grug_file *file;
+	struct spawn_command command;
+};
+
+struct tick_map_set_i32 {
+	u64 id;
+	char *key;
+	i32 value;
+};
+
+// A game function call made during a parallel tick, which changes shared state,
+// and so gets applied by merge_tick_buffers() after the tick instead
+// The strings are owned by the mod's .so, except for message, which is copied
+struct tick_command {
+	enum tick_command_type type;
+	union {
+		struct tick_spawn spawn;
+		struct tick_map_set_i32 map_set_i32;
+		char *sound_path;
+		u64 despawn_id;
+		char *message;
+	};
+};
+
+// Every range of entities that a parallel tick splits the tick groups into gets its own buffer,
+// and the buffers are merged in range order, so the outcome doesn't depend on which worker ran which range
+struct tick_buffer {
+	struct tick_command *commands;
+	size_t commands_size;
+	size_t commands_capacity;
+
+	// Where the commands of the entity whose on_tick() is running start,
+	// so game_fn_map_get_i32() can see the entity's own writes
+	size_t entity_commands_start;
+
+	// Slots taken off the free list before the tick, so spawning can return valid IDs right away
+	u32 reserved_slots[RESERVED_SLOTS_PER_TICK_RANGE];
+	size_t reserved_slots_size;
+	size_t used_reserved_slots;
+
+	unsigned int rand_seed;
+
+	// What message is for the main thread, so the workers don't each need a MAX_MESSAGE_LENGTH buffer
+	char message[MAX_TICK_MESSAGE_LENGTH];
+};
+
+static struct tick_buffer tick_buffers[MAX_WORKERS];
+
+// The buffer of the range that this thread is ticking, or NULL outside of a parallel tick
+static _Thread_local struct tick_buffer *tick_buffer;
+
+#ifndef HEADLESS
 static size_t drawn_entities;
+#endif
 
+#ifndef HEADLESS
 static int debug_line_number;
+#endif
 
 static b2WorldId world_id;
 
+#ifndef HEADLESS
+// How far the drawn frame is between the previous and current tick, between 0.0f and 1.0f
+static float interpolation_alpha;
+
+// Every visible entity is turned into a quad, which is put in the batch of its texture
+// Each batch is then drawn in one go, so the GPU only has to switch textures once per texture
+struct sprite_quad {
+	// Top-left, bottom-left, bottom-right and top-right, in screen space
+	Vector2 corners[4];
+
+	bool flipped;
+};
+
+struct sprite_batch {
+	struct sprite_quad *quads;
+	size_t size;
+	size_t capacity;
+};
+
+// Indexed like textures[]
+static struct sprite_batch sprite_batches[MAX_TEXTURES];
+
+// The textures[] indices of the batches that got quads this frame
+static u32 used_sprite_batches[MAX_TEXTURES];
+static size_t used_sprite_batches_size;
+#endif
+
+#ifndef HEADLESS
 static Texture background_texture;
+#endif
 
-struct measurement {
-	struct timespec time;
-	char *description;
+// Every entity that uses the same sprite shares a single texture entry,
+// so a sprite is only uploaded to the GPU once, no matter how many entities use it
+struct texture_entry {
+	// Interned, so it's compared by address
+	char *path;
+
+	Texture texture;
+
+	// The entities using this texture, which excludes parked bullets
+	struct entity_list users;
+
+	// Bumped whenever the texture is released or reloaded, so decoded images that are out of date get thrown away
+	u32 generation;
+
+	// The texture gets unloaded when this drops to 0,
+	// but the entry is kept, so its index can be handed out again for the same path
+	size_t ref_count;
+};
+
+// Every unique string is copied into this table once, and never freed
+// The strings that grug passes to game functions live in the mod's .so,
+// and start dangling the moment the .so is unloaded,
+// while interned strings stay valid, and can be compared by address
+struct interned_string {
+	char *string;
+	u32 hash;
+};
+
+// An open addressing hash set with linear probing
+// The capacity is always a power of 2, and at least twice the size
+static struct interned_string *interned_strings;
+static size_t interned_strings_size;
+static size_t interned_strings_capacity;
+
+static struct texture_entry textures[MAX_TEXTURES];
+static u32 texture_buckets[MAX_TEXTURES];
+static u32 texture_chains[MAX_TEXTURES];
+static size_t textures_size;
+static size_t loaded_textures;
+
+// A timed part of a frame, which is either explicitly begun and ended,
+// or is the time between two record() calls inside of one
+struct zone {
+	char *name;
+	u32 depth;
+	long long wall_start_ns;
+	long long wall_ns;
+
+	// Process CPU time, so it includes the time that workers spent on the zone
+	long long cpu_ns;
+};
+
+// The zones are stored in the order they were begun, so a zone's children come right after it
+struct profiled_frame {
+	struct zone zones[MAX_FRAME_ZONES];
+	size_t zones_size;
+	size_t dropped_zones;
+};
+
+// A ring buffer of the last PROFILED_FRAMES frames
+static struct profiled_frame profiled_frames[PROFILED_FRAMES];
+static size_t profiled_frames_start;
+static size_t profiled_frames_size;
+
+// NULL when no frame is being profiled
+static struct profiled_frame *profiled_frame;
+
+struct open_zone {
+	// SIZE_MAX if the frame ran out of zones
+	size_t zone_index;
+
+	long long wall_start_ns;
+	long long cpu_start_ns;
+
+	// Where the next record() of a child starts
+	long long mark_wall_ns;
+	long long mark_cpu_ns;
+};
+
+static struct open_zone open_zones[MAX_ZONE_DEPTH];
+static size_t open_zones_size;
+
+#ifndef HEADLESS
+// A histogram of a zone's total wall time per frame, over the frames in profiled_frames[]
+// Frames are added to it when they end, and removed when the ring buffer overwrites them,
+// so the overlay's percentiles never require rescanning the whole history
+// Bucket 0 counts everything under 1 microsecond, and bucket i the times under 2^(i / ZONE_HISTOGRAM_BUCKETS_PER_DOUBLING) microseconds
+struct zone_histogram {
+	char *name;
+	u32 depth;
+	size_t frames;
+	u32 counts[ZONE_HISTOGRAM_BUCKETS];
+};
+
+static struct zone_histogram zone_histograms[MAX_ZONE_STATS];
+static size_t zone_histograms_size;
+
+// The percentiles of a zone's total wall time per frame, in milliseconds
+struct zone_stats {
+	char *name;
+	u32 depth;
+	double p50;
+	double p95;
+	double p99;
+	double max;
+};
+
+static struct zone_stats zone_stats[MAX_ZONE_STATS];
+static size_t zone_stats_size;
+static size_t frames_since_zone_stats;
+#endif
+
+// Box2D splits the work of b2World_Step() into tasks, which it hands to enqueue_task()
+// Every task is split into chunks, which are spread over the queues of the workers
+// A worker runs the chunks in its own queue, and steals chunks from the other queues once its own is empty
+// Worker 0 is the main thread, which only runs chunks while it is waiting in finish_task()
+struct task {
+	b2TaskCallback *callback;
+	void *context;
+	atomic_int unfinished_chunks;
+
+	// Whether the task calls on_tick()s, rather than being one of Box2D's, so its time is counted separately
+	bool is_tick;
+};
+
+struct task_chunk {
+	struct task *task;
+	int start;
+	int end;
+};
+
+struct worker {
+	pthread_t thread;
+
+	pthread_mutex_t mutex;
+	struct task_chunk chunks[MAX_WORKER_CHUNKS];
+	size_t chunks_start;
+	size_t chunks_size;
+
+	// Nanoseconds spent running Box2D's chunks and parallel tick chunks since the last reset_worker_utilization() call
+	atomic_llong busy_ns;
+	atomic_llong tick_busy_ns;
 };
 
-static struct measurement measurements[MAX_MEASUREMENTS];
-static size_t measurements_size;
+static struct worker workers[MAX_WORKERS];
+static size_t worker_count;
+
+// All tasks are finished by the end of b2World_Step(), so this is reset before every step
+static struct task tasks[MAX_TASKS];
+static size_t tasks_size;
+
+static size_t next_chunk_worker;
+
+static atomic_int queued_chunks;
+static atomic_bool workers_should_stop;
+static pthread_mutex_t workers_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_wake_condition = PTHREAD_COND_INITIALIZER;
+
+// Nanoseconds spent in b2World_Step() and in parallel ticks since the last reset_worker_utilization() call
+static long long world_step_ns;
+static long long parallel_tick_ns;
+
+// Passed as the user context of the parallel tick's task, which is how enqueue_task() tells it apart from Box2D's
+static char parallel_tick_task_marker;
 
 static struct gun_on_spawn_data gun_on_spawn_data;
 static struct bullet_on_spawn_data bullet_on_spawn_data;
@@ -137,31 +641,155 @@ static struct counter_on_spawn_data counter_on_spawn_data;
 
 static struct entity *gun;
 
-static struct grug_file *type_files[MAX_TYPE_FILES];
+// The files of every entity type, and of every entity name, in the mods tree
+// The tree is walked again after every regeneration, since adding or removing a .grug file
+// can move grug's files arrays without there being a reload for it
+struct type_files {
+	// Interned, so it's compared by address
+	char *entity_type;
+
+	struct grug_file **files;
+	size_t size;
+	size_t capacity;
+};
+
+static struct type_files type_files[MAX_ENTITY_TYPES];
 static size_t type_files_size;
 
+// An open addressing hash map with linear probing, keyed by the interned entity name
+// Every file is in it both as "mod:name" and as just "name", so the capacity is
+// always a power of 2, and at least four times the number of files
+struct named_file {
+	char *entity;
+	struct grug_file *file;
+
+	// Set when several mods have a file with this unqualified name
+	bool ambiguous;
+};
+
+static struct named_file *named_files;
+static size_t named_files_capacity;
+
+// Whether the last regeneration failed, in which case the game keeps running the last code that compiled
+static bool mods_failed_to_regenerate;
+
 static bool debug_info = true;
+#ifndef HEADLESS
 static bool draw_bounding_box = false;
+#endif
 
 struct message_data {
 	char message[MAX_MESSAGE_LENGTH];
 	struct timespec time;
 };
 
+// Every heap allocation made by this file and by Box2D is counted against one of these
+enum memory_subsystem {
+	MEMORY_BOX2D,
+	MEMORY_ENTITIES,
+	MEMORY_GLOBALS,
+	MEMORY_I32_MAPS,
+	MEMORY_STRINGS,
+	MEMORY_COMMANDS,
+	MEMORY_TICK_GROUPS,
+	MEMORY_BULLET_POOLS,
+	MEMORY_SPRITE_BATCHES,
+	MEMORY_ENTITY_LISTS,
+	MEMORY_MOD_INDEX,
+	MEMORY_SUBSYSTEM_COUNT,
+};
+
+static char *memory_subsystem_names[MEMORY_SUBSYSTEM_COUNT] = {
+	[MEMORY_BOX2D] = "box2d",
+	[MEMORY_ENTITIES] = "entities",
+	[MEMORY_GLOBALS] = "grug globals",
+	[MEMORY_I32_MAPS] = "i32 maps",
+	[MEMORY_STRINGS] = "interned strings",
+	[MEMORY_COMMANDS] = "commands and messages",
+	[MEMORY_TICK_GROUPS] = "tick groups",
+	[MEMORY_BULLET_POOLS] = "bullet pools",
+	[MEMORY_SPRITE_BATCHES] = "sprite batches",
+	[MEMORY_ENTITY_LISTS] = "entity lists",
+	[MEMORY_MOD_INDEX] = "mod index",
+};
+
+// Atomic, since Box2D's workers and parallel ticks allocate too
+struct memory_usage {
+	atomic_llong current_bytes;
+	atomic_llong peak_bytes;
+	atomic_llong allocations;
+};
+
+static struct memory_usage memory_usages[MEMORY_SUBSYSTEM_COUNT];
+
+#ifndef HEADLESS
+// Lets the overlay show how many allocations each subsystem made since it was last drawn
+static long long allocations_at_last_draw[MEMORY_SUBSYSTEM_COUNT];
+#endif
+
+// Prepended to every counted allocation, so that freeing it knows what to subtract
+// Its size keeps the allocation 16 byte aligned, just like malloc()
+struct allocation_header {
+	size_t size;
+	u32 subsystem;
+
+	// How far the allocation starts before the returned pointer, which is larger for Box2D's aligned allocations
+	u32 offset;
+};
+
 static struct message_data messages[MAX_MESSAGES];
 static size_t messages_size;
 static size_t messages_start;
+// Only formatted into by the main thread
+// Code that can run during a parallel tick uses add_formatted_message() instead
 static char message[MAX_MESSAGE_LENGTH];
 
-static u64 next_entity_id;
+// Entity IDs are handles into entity_slots[]
+// The lower 32 bits of an ID are the slot index, and the upper 32 bits the slot's generation
+// See https://floooh.github.io/2018/06/17/handles-vs-pointers.html
+struct entity_slot {
+	u32 generation;
+
+	// Index into entities[], or UINT32_MAX if the slot is free
+	u32 entity_index;
+
+	// The next slot in the free list, or UINT32_MAX
+	u32 next_free;
+};
+
+static struct entity_slot *entity_slots;
+static size_t entity_slots_size;
+static size_t entity_slots_capacity;
+static u32 first_free_entity_slot = UINT32_MAX;
+
+// Every .wav is only decoded once, after which it gets played through a fixed pool of voices
+// The voices are aliases, so they share the sample data of the decoded sound
+struct sound_entry {
+	// Interned, so it's compared by address
+	char *path;
+
+	Sound sound;
+
+	Sound voices[VOICES_PER_SOUND];
+
+	// The volume each voice was last played at, for deciding which voice to steal
+	float voice_volumes[VOICES_PER_SOUND];
+
+	// When each voice was last played, as a count of voices_played, so ties steal the oldest voice
+	u64 voice_play_counts[VOICES_PER_SOUND];
+};
 
-static Sound metal_blunt_1;
-static Sound metal_blunt_2;
+static struct sound_entry sounds[MAX_SOUNDS];
+static u32 sound_buckets[MAX_SOUNDS];
+static u32 sound_chains[MAX_SOUNDS];
+static size_t sounds_size;
 
-static size_t sound_cooldown_metal_blunt_1;
-static size_t sound_cooldown_metal_blunt_2;
+static u32 metal_blunt_1;
+static u32 metal_blunt_2;
 
+#ifndef HEADLESS
 static bool paused = false;
+#endif
 
 struct gun_on_fns {
 	void (*spawn)(void *globals);
@@ -186,951 +814,4382 @@ struct counter_on_fns {
 	void (*tick)(void *globals);
 };
 
-static void add_message(void) {
-	struct message_data *error = &messages[(messages_start + messages_size) % MAX_MESSAGES];
+static void count_allocation(enum memory_subsystem subsystem, long long bytes) {
+	struct memory_usage *usage = &memory_usages[subsystem];
 
-	if (messages_size < MAX_MESSAGES) {
-		messages_size++;
-	} else {
-		// We'll be overwriting the oldest message
-		messages_start = (messages_start + 1) % MAX_MESSAGES;
-	}
+	long long current = atomic_fetch_add(&usage->current_bytes, bytes) + bytes;
 
-	memcpy(error->message, message, strlen(message) + 1);
+	if (bytes > 0) {
+		atomic_fetch_add(&usage->allocations, 1);
 
-	clock_gettime(CLOCK_MONOTONIC, &error->time);
+		long long peak = atomic_load(&usage->peak_bytes);
+		while (current > peak && !atomic_compare_exchange_weak(&usage->peak_bytes, &peak, current)) {}
+	}
 }
 
-// TODO: Optimize this to O(1), by adding an array that maps
-// TODO: the entity ID to the entities[] index
-static size_t get_entity_index_from_entity_id(u64 id) {
-	for (size_t i = 0; i < entities_size; i++) {
-		if (entities[i].id == id) {
-			return i;
-		}
+// Works like realloc(), and returns NULL when the allocation failed
+static void *counted_realloc(enum memory_subsystem subsystem, void *ptr, size_t size) {
+	struct allocation_header *old_header = ptr ? (struct allocation_header *)ptr - 1 : NULL;
+	size_t old_size = old_header ? old_header->size : 0;
+
+	assert(!old_header || (old_header->subsystem == subsystem && old_header->offset == sizeof(*old_header)));
+
+	struct allocation_header *header = realloc(old_header, sizeof(*header) + size);
+	if (!header) {
+		return NULL;
 	}
 
-	snprintf(message, sizeof(message), "Failed to find the entity with ID %ld\n", id);
-	add_message();
+	header->size = size;
+	header->subsystem = subsystem;
+	header->offset = sizeof(*header);
 
-	return SIZE_MAX;
+	count_allocation(subsystem, (long long)size - (long long)old_size);
+
+	return header + 1;
 }
 
-// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elf.c#l193
-static u32 elf_hash(const char *namearg) {
-	u32 h = 0;
+static void *counted_malloc(enum memory_subsystem subsystem, size_t size) {
+	return counted_realloc(subsystem, NULL, size);
+}
 
-	for (const unsigned char *name = (const unsigned char *) namearg; *name; name++) {
-		h = (h << 4) + *name;
-		h ^= (h >> 24) & 0xf0;
+static void *counted_calloc(enum memory_subsystem subsystem, size_t count, size_t size) {
+	void *ptr = counted_malloc(subsystem, count * size);
+	if (ptr) {
+		memset(ptr, 0, count * size);
 	}
-
-	return h & 0x0fffffff;
+	return ptr;
 }
 
-static bool streq(char *a, char *b) {
-	return strcmp(a, b) == 0;
+static char *counted_strdup(enum memory_subsystem subsystem, char *string) {
+	size_t size = strlen(string) + 1;
+	char *copy = counted_malloc(subsystem, size);
+	if (copy) {
+		memcpy(copy, string, size);
+	}
+	return copy;
 }
 
-void game_fn_map_set_i32(u64 id, char *key, i32 value) {
-	size_t entity_index = get_entity_index_from_entity_id(id);
-	if (entity_index == SIZE_MAX) {
+static void counted_free(void *ptr) {
+	if (!ptr) {
 		return;
 	}
 
-	struct i32_map *map = entities[entity_index].i32_map;
+	struct allocation_header *header = (struct allocation_header *)ptr - 1;
 
-	u32 bucket_index = elf_hash(key) % MAX_I32_MAP_ENTRIES;
+	count_allocation(header->subsystem, -(long long)header->size);
 
-	u32 i = map->buckets[bucket_index];
+	free((char *)ptr - header->offset);
+}
 
-	while (true) {
-		if (i == UINT32_MAX) {
-			break;
-		}
+// The alignment has to be at least 16, so the header fits in the padding before the returned pointer
+static void *counted_aligned_alloc(enum memory_subsystem subsystem, size_t size, size_t alignment) {
+	assert(alignment >= sizeof(struct allocation_header));
 
-		if (streq(key, map->keys[i])) {
-			break;
-		}
+	// aligned_alloc() requires the size to be a multiple of the alignment
+	size_t padded_size = (alignment + size + alignment - 1) / alignment * alignment;
 
-		i = map->chains[i];
+	char *raw = aligned_alloc(alignment, padded_size);
+	if (!raw) {
+		return NULL;
 	}
 
-	if (i == UINT32_MAX) {
-		if (map->size >= MAX_I32_MAP_ENTRIES) {
-			snprintf(message, sizeof(message), "The i32 map of the entity with ID %ld has %d entries, which exceeds MAX_I32_MAP_ENTRIES\n", id, MAX_I32_MAP_ENTRIES);
-			add_message();
+	char *ptr = raw + alignment;
 
-			return;
-		}
+	struct allocation_header *header = (struct allocation_header *)ptr - 1;
+	header->size = size;
+	header->subsystem = subsystem;
+	header->offset = alignment;
 
-		i = map->size;
+	count_allocation(subsystem, size);
 
-		map->keys[i] = strdup(key);
-		map->values[i] = value;
-		map->chains[i] = map->buckets[bucket_index];
-		map->buckets[bucket_index] = i;
+	return ptr;
+}
 
-		map->size++;
-	} else {
-		free(map->keys[i]);
-		map->keys[i] = strdup(key);
-		map->values[i] = value;
-	}
+// Box2D asks for alignments of at least 16
+static void *allocate_box2d(unsigned int size, int alignment) {
+	return counted_aligned_alloc(MEMORY_BOX2D, size, alignment);
 }
 
-i32 game_fn_map_get_i32(u64 id, char *key) {
-	size_t entity_index = get_entity_index_from_entity_id(id);
-	if (entity_index == SIZE_MAX) {
-		return -1;
+static struct tick_command *push_tick_command(enum tick_command_type type) {
+	if (tick_buffer->commands_size >= tick_buffer->commands_capacity) {
+		tick_buffer->commands_capacity = tick_buffer->commands_capacity == 0 ? INITIAL_TICK_COMMANDS_CAPACITY : tick_buffer->commands_capacity * 2;
+		tick_buffer->commands = counted_realloc(MEMORY_COMMANDS, tick_buffer->commands, tick_buffer->commands_capacity * sizeof(*tick_buffer->commands));
+		if (!tick_buffer->commands) {
+			fprintf(stderr, "Failed to grow a tick buffer to %zu commands\n", tick_buffer->commands_capacity);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	struct i32_map *map = entities[entity_index].i32_map;
-
-	if (map->size == 0) {
-		snprintf(message, sizeof(message), "The i32 map of the entity with ID %ld is empty, so can't contain the key '%s'\n", id, key);
-		add_message();
+	struct tick_command *command = &tick_buffer->commands[tick_buffer->commands_size++];
+	command->type = type;
+	return command;
+}
 
-		return -1;
+static void add_message(void) {
+	if (tick_buffer) {
+		char *copy = counted_strdup(MEMORY_COMMANDS, tick_buffer->message);
+		if (!copy) {
+			fprintf(stderr, "Failed to copy a message during a parallel tick\n");
+			exit(EXIT_FAILURE);
+		}
+		push_tick_command(TICK_COMMAND_MESSAGE)->message = copy;
+		return;
 	}
 
-	u32 i = map->buckets[elf_hash(key) % MAX_I32_MAP_ENTRIES];
+	struct message_data *error = &messages[(messages_start + messages_size) % MAX_MESSAGES];
 
-	while (true) {
-		if (i == UINT32_MAX) {
-			snprintf(message, sizeof(message), "The i32 map of the entity with ID %ld doesn't contain the key '%s'\n", id, key);
-			add_message();
+	if (messages_size < MAX_MESSAGES) {
+		messages_size++;
+	} else {
+		// We'll be overwriting the oldest message
+		messages_start = (messages_start + 1) % MAX_MESSAGES;
+	}
 
-			break;
-		}
+	memcpy(error->message, message, strlen(message) + 1);
 
-		if (streq(key, map->keys[i])) {
-			return map->values[i];
-		}
+	clock_gettime(CLOCK_MONOTONIC, &error->time);
+}
 
-		i = map->chains[i];
+// Formats into the running range's tick buffer during a parallel tick, and into message otherwise
+static void add_formatted_message(char *format, ...) {
+	va_list args;
+	va_start(args, format);
+
+	if (tick_buffer) {
+		vsnprintf(tick_buffer->message, sizeof(tick_buffer->message), format, args);
+	} else {
+		vsnprintf(message, sizeof(message), format, args);
 	}
 
-	return -1;
+	va_end(args);
+
+	add_message();
 }
 
-bool game_fn_map_has_i32(u64 id, char *key) {
-	size_t entity_index = get_entity_index_from_entity_id(id);
-	if (entity_index == SIZE_MAX) {
-		return false;
+static u64 get_entity_id(u32 slot_index) {
+	return ((u64)entity_slots[slot_index].generation << 32) | slot_index;
+}
+
+static u32 get_entity_slot_index(u64 id) {
+	return id & UINT32_MAX;
+}
+
+// Returns UINT32_MAX when every slot is either in use or retired
+static u32 allocate_entity_slot(void) {
+	u32 slot_index = first_free_entity_slot;
+
+	if (slot_index != UINT32_MAX) {
+		first_free_entity_slot = entity_slots[slot_index].next_free;
+	} else if (entity_slots_size < UINT32_MAX) {
+		if (entity_slots_size >= entity_slots_capacity) {
+			entity_slots_capacity = entity_slots_capacity == 0 ? INITIAL_ENTITIES_CAPACITY : entity_slots_capacity * 2;
+			entity_slots = counted_realloc(MEMORY_ENTITIES, entity_slots, entity_slots_capacity * sizeof(*entity_slots));
+			if (!entity_slots) {
+				fprintf(stderr, "Failed to grow entity_slots[] to %zu slots\n", entity_slots_capacity);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		slot_index = entity_slots_size++;
+		entity_slots[slot_index].generation = 0;
+	} else {
+		return UINT32_MAX;
 	}
 
-	struct i32_map *map = entities[entity_index].i32_map;
+	// A slot that is reserved for a parallel tick's spawn doesn't have an entity yet
+	entity_slots[slot_index].entity_index = UINT32_MAX;
+	entity_slots[slot_index].next_free = UINT32_MAX;
 
-	if (map->size == 0) {
-		return false;
+	return slot_index;
+}
+
+static void free_entity_slot(u64 id) {
+	u32 slot_index = get_entity_slot_index(id);
+	struct entity_slot *slot = &entity_slots[slot_index];
+
+	slot->entity_index = UINT32_MAX;
+
+	// Bumping the generation makes every ID that still refers to this slot stale
+	slot->generation++;
+
+	// A slot whose generation would wrap around is retired for good,
+	// so that an old ID can never come back to life by referring to a new entity
+	if (slot->generation == UINT32_MAX) {
+		return;
 	}
 
-	u32 i = map->buckets[elf_hash(key) % MAX_I32_MAP_ENTRIES];
+	slot->next_free = first_free_entity_slot;
+	first_free_entity_slot = slot_index;
+}
 
-	while (true) {
-		if (i == UINT32_MAX) {
-			break;
-		}
+static struct entity_cold *get_cold(struct entity *entity) {
+	return &entity_colds[entity - entities];
+}
 
-		if (streq(key, map->keys[i])) {
-			return true;
-		}
+static void grow_entities(void) {
+	size_t gun_index = gun ? (size_t)(gun - entities) : SIZE_MAX;
 
-		i = map->chains[i];
+	entities_capacity = entities_capacity == 0 ? INITIAL_ENTITIES_CAPACITY : entities_capacity * 2;
+
+	entities = counted_realloc(MEMORY_ENTITIES, entities, entities_capacity * sizeof(*entities));
+	entity_colds = counted_realloc(MEMORY_ENTITIES, entity_colds, entities_capacity * sizeof(*entity_colds));
+	if (!entities || !entity_colds) {
+		fprintf(stderr, "Failed to grow entities[] to %zu entities\n", entities_capacity);
+		exit(EXIT_FAILURE);
 	}
 
-	return false;
+	if (gun_index != SIZE_MAX) {
+		gun = entities + gun_index;
+	}
 }
 
-void game_fn_play_sound(char *path) {
-	Sound sound = LoadSound(path);
-	assert(sound.frameCount > 0);
+// Returns SIZE_MAX if the entity doesn't exist (anymore)
+static size_t find_entity_index(u64 id) {
+	u32 slot_index = get_entity_slot_index(id);
+
+	if (slot_index < entity_slots_size) {
+		struct entity_slot slot = entity_slots[slot_index];
 
-	PlaySound(sound);
+		if (slot.entity_index != UINT32_MAX && slot.generation == id >> 32) {
+			return slot.entity_index;
+		}
+	}
 
-	// TODO: This doesn't work here, since it frees the sound before it gets played
-	// UnloadSound(sound);
+	return SIZE_MAX;
 }
 
-void game_fn_print_bool(bool b) {
-	snprintf(message, sizeof(message), "%s\n", b ? "true" : "false");
-	add_message();
+static size_t get_entity_index_from_entity_id(u64 id) {
+	size_t entity_index = find_entity_index(id);
+	if (entity_index != SIZE_MAX) {
+		return entity_index;
+	}
+
+	add_formatted_message("Failed to find the entity with ID %ld\n", id);
+
+	return SIZE_MAX;
 }
 
-void game_fn_print_string(char *s) {
-	snprintf(message, sizeof(message), "%s\n", s);
-	add_message();
+// From https://sourceware.org/git/?p=binutils-gdb.git;a=blob;f=bfd/elf.c#l193
+static u32 elf_hash(const char *namearg) {
+	u32 h = 0;
+
+	for (const unsigned char *name = (const unsigned char *) namearg; *name; name++) {
+		h = (h << 4) + *name;
+		h ^= (h >> 24) & 0xf0;
+	}
+
+	return h & 0x0fffffff;
 }
 
-void game_fn_print_f32(float f) {
-	snprintf(message, sizeof(message), "%f\n", f);
-	add_message();
+static bool streq(char *a, char *b) {
+	return strcmp(a, b) == 0;
 }
 
-void game_fn_print_i32(i32 i) {
-	snprintf(message, sizeof(message), "%d\n", i);
-	add_message();
+// Returns the entry of the string, or the empty entry where the string should be inserted
+static struct interned_string *find_interned_string_entry(char *string, u32 hash) {
+	size_t mask = interned_strings_capacity - 1;
+
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct interned_string *entry = &interned_strings[i];
+
+		if (!entry->string || (entry->hash == hash && streq(string, entry->string))) {
+			return entry;
+		}
+	}
 }
 
-float game_fn_rand(float min, float max) {
-    float range = max - min;
-    return min + rand() / (double)RAND_MAX * range;
+// Returns NULL if the string was never interned
+static char *find_interned(char *string) {
+	if (interned_strings_size == 0) {
+		return NULL;
+	}
+	return find_interned_string_entry(string, elf_hash(string))->string;
 }
 
-static b2BodyDef get_bullet_body_def(b2Vec2 muzzle_pos, float angle_in_degrees, float velocity_in_meters_per_second) {
-	b2Rot rot = b2Body_GetRotation(gun->body_id);
-	double gun_angle = b2Rot_GetAngle(rot);
-	double added_angle = angle_in_degrees * DEG2RAD;
-	bool facing_left = (gun_angle > PI / 2) || (gun_angle < -PI / 2);
-	rot = b2MakeRot(gun_angle + added_angle * (facing_left ? -1 : 1));
+static char *intern(char *string) {
+	u32 hash = elf_hash(string);
 
-	b2Vec2 velocity_unrotated = (b2Vec2){.x=velocity_in_meters_per_second * PIXELS_PER_METER, .y=0};
-	b2Vec2 velocity = b2RotateVector(rot, velocity_unrotated);
+	if (interned_strings_size > 0) {
+		struct interned_string *entry = find_interned_string_entry(string, hash);
+		if (entry->string) {
+			return entry->string;
+		}
+	}
 
-	b2BodyDef body_def = b2DefaultBodyDef();
+	// Keeps the load factor at or below 0.5
+	if ((interned_strings_size + 1) * 2 > interned_strings_capacity) {
+		struct interned_string *old_entries = interned_strings;
+		size_t old_capacity = interned_strings_capacity;
 
-	body_def.type = b2_dynamicBody;
-	body_def.position = muzzle_pos;
-	body_def.rotation = b2MakeRot(gun_angle);
-	body_def.linearVelocity = velocity;
+		interned_strings_capacity = old_capacity == 0 ? INITIAL_INTERNED_STRINGS_CAPACITY : old_capacity * 2;
 
-	return body_def;
-}
+		interned_strings = counted_calloc(MEMORY_STRINGS, interned_strings_capacity, sizeof(*interned_strings));
+		if (!interned_strings) {
+			fprintf(stderr, "Failed to grow interned_strings[] to %zu entries\n", interned_strings_capacity);
+			exit(EXIT_FAILURE);
+		}
 
-static char *get_texture_path(struct entity *entity) {
-	switch (entity->type) {
-		case OBJECT_GUN:
-			return gun_on_spawn_data.sprite_path;
-		case OBJECT_BULLET:
-			return bullet_on_spawn_data.sprite_path;
-		case OBJECT_BOX:
-			return box_on_spawn_data.sprite_path;
-		case OBJECT_COUNTER:
-			break;
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old_entries[i].string) {
+				*find_interned_string_entry(old_entries[i].string, old_entries[i].hash) = old_entries[i];
+			}
+		}
+
+		counted_free(old_entries);
 	}
-	assert(false);
-}
 
-static b2Vec2 get_bullet_muzzle_pos(struct entity *entity, float x, float y) {
-	char *texture_path = get_texture_path(entity);
+	struct interned_string *entry = find_interned_string_entry(string, hash);
 
-	Texture texture = LoadTexture(texture_path);
-	assert(texture.id > 0);
+	entry->string = counted_strdup(MEMORY_STRINGS, string);
+	entry->hash = hash;
 
-	b2Vec2 local_point = {
-		.x = gun->texture.width / 2.0f + texture.width / 2.0f + x,
-		.y = y
-	};
+	interned_strings_size++;
 
-	UnloadTexture(texture);
+	return entry->string;
+}
 
-	return b2Body_GetWorldPoint(gun->body_id, local_point);
+// Interned strings are unique, so hashing their address is enough
+static u32 hash_interned(char *interned) {
+	return ((uintptr_t)interned >> 4) * 2654435761u;
 }
 
-static void call_on_despawn(struct entity *entity, void *on_fns) {
-	switch (entity->type) {
-		case OBJECT_GUN: {
-			struct gun_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->despawn) {
-				break;
-			}
-			cast_on_fns->despawn(entity->globals);
-			break;
-		}
-		case OBJECT_BULLET: {
-			struct bullet_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->despawn) {
-				break;
-			}
-			cast_on_fns->despawn(entity->globals);
-			break;
-		}
-		case OBJECT_BOX: {
-			struct box_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->despawn) {
-				break;
-			}
-			cast_on_fns->despawn(entity->globals);
-			break;
+static struct type_files *get_or_add_type_files(char *entity_type) {
+	for (size_t i = 0; i < type_files_size; i++) {
+		if (type_files[i].entity_type == entity_type) {
+			return &type_files[i];
 		}
-		case OBJECT_COUNTER: {
-			struct counter_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->despawn) {
-				break;
+	}
+
+	if (type_files_size >= MAX_ENTITY_TYPES) {
+		fprintf(stderr, "There are more than %d entity types, exceeding MAX_ENTITY_TYPES\n", MAX_ENTITY_TYPES);
+		exit(EXIT_FAILURE);
+	}
+
+	type_files[type_files_size] = (struct type_files){.entity_type = entity_type};
+
+	return &type_files[type_files_size++];
+}
+
+static void index_grug_files_impl(struct grug_mod_dir dir) {
+	for (size_t i = 0; i < dir.dirs_size; i++) {
+		index_grug_files_impl(dir.dirs[i]);
+	}
+
+	for (size_t i = 0; i < dir.files_size; i++) {
+		struct type_files *files = get_or_add_type_files(intern(dir.files[i].entity_type));
+
+		if (files->size >= files->capacity) {
+			files->capacity = files->capacity == 0 ? INITIAL_TYPE_FILES_CAPACITY : files->capacity * 2;
+			files->files = counted_realloc(MEMORY_MOD_INDEX, files->files, files->capacity * sizeof(*files->files));
+			if (!files->files) {
+				fprintf(stderr, "Failed to grow the '%s' files to %zu files\n", files->entity_type, files->capacity);
+				exit(EXIT_FAILURE);
 			}
-			cast_on_fns->despawn(entity->globals);
-			break;
 		}
+
+		files->files[files->size++] = &dir.files[i];
 	}
 }
 
-static void despawn_entity(size_t entity_index) {
-	struct entity *entity = &entities[entity_index];
+static struct named_file *find_named_file_entry(char *entity) {
+	size_t mask = named_files_capacity - 1;
 
-	call_on_despawn(entity, entity->on_fns);
+	for (size_t i = hash_interned(entity) & mask;; i = (i + 1) & mask) {
+		struct named_file *entry = &named_files[i];
+
+		if (!entry->entity || entry->entity == entity) {
+			return entry;
+		}
+	}
+}
 
-	if (entities[entity_index].texture.id > 0) {
-		UnloadTexture(entities[entity_index].texture);
+// Rebuilds the type and name indexes from scratch
+static void index_grug_files(void) {
+	// The types are kept, so their arrays get reused
+	for (size_t i = 0; i < type_files_size; i++) {
+		type_files[i].size = 0;
+	}
 
-		free(entities[entity_index].texture_path);
+	index_grug_files_impl(grug_mods);
 
-		b2DestroyBody(entities[entity_index].body_id);
+	size_t file_count = 0;
+	for (size_t i = 0; i < type_files_size; i++) {
+		file_count += type_files[i].size;
 	}
 
-	struct i32_map *map = entities[entity_index].i32_map;
-	for (size_t i = 0; i < map->size; i++) {
-		free(map->keys[i]);
+	size_t capacity = INITIAL_TYPE_FILES_CAPACITY;
+	while (capacity < file_count * 4) {
+		capacity *= 2;
 	}
-	free(map);
 
-	entities[entity_index] = entities[--entities_size];
+	if (capacity != named_files_capacity) {
+		counted_free(named_files);
 
-	if (entities[entity_index].type == OBJECT_GUN) {
-		gun = entities + entity_index;
+		named_files_capacity = capacity;
+		named_files = counted_calloc(MEMORY_MOD_INDEX, named_files_capacity, sizeof(*named_files));
+		if (!named_files) {
+			fprintf(stderr, "Failed to allocate named_files[] with %zu entries\n", named_files_capacity);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		memset(named_files, 0, named_files_capacity * sizeof(*named_files));
 	}
 
-	// If the removed entity wasn't at the very end of the entities array,
-	// update entity_index's userdata
-	if (entity_index < entities_size && entities[entity_index].texture.id > 0) {
-		b2Body_SetUserData(entities[entity_index].body_id, (void *)entity_index);
+	for (size_t i = 0; i < type_files_size; i++) {
+		for (size_t file_index = 0; file_index < type_files[i].size; file_index++) {
+			struct grug_file *file = type_files[i].files[file_index];
+			char *entity = intern(file->entity);
+
+			*find_named_file_entry(entity) = (struct named_file){
+				.entity = entity,
+				.file = file,
+			};
+
+			char *colon = strchr(file->entity, ':');
+			if (!colon) {
+				continue;
+			}
+
+			char *name = intern(colon + 1);
+			struct named_file *entry = find_named_file_entry(name);
+
+			if (entry->entity && entry->file != file) {
+				entry->ambiguous = true;
+			} else {
+				*entry = (struct named_file){
+					.entity = name,
+					.file = file,
+				};
+			}
+		}
 	}
 }
 
-void game_fn_despawn_entity(u64 id) {
-	size_t entity_index = get_entity_index_from_entity_id(id);
+// Returns NULL if there are no files of this type
+static struct grug_file **get_type_files(char *entity_type, size_t *size) {
+	char *interned = find_interned(entity_type);
 
-	if (entity_index != SIZE_MAX) {
-		despawn_entity(entity_index);
+	for (size_t i = 0; i < type_files_size; i++) {
+		if (type_files[i].entity_type == interned) {
+			*size = type_files[i].size;
+			return type_files[i].files;
+		}
 	}
+
+	*size = 0;
+	return NULL;
 }
 
-static void write_on_spawn_data_to_entity(struct entity *entity) {
-	switch (entity->type) {
-		case OBJECT_GUN:
-			entity->gun.ms_per_round_fired = gun_on_spawn_data.ms_per_round_fired;
-			break;
-		case OBJECT_BULLET:
-			entity->bullet.density = bullet_on_spawn_data.density;
-			break;
-		case OBJECT_BOX:
-			entity->box.sprite_path = box_on_spawn_data.sprite_path;
-			break;
-		case OBJECT_COUNTER:
-			break;
+// Returns NULL if there's no file with this entity name, or if the unqualified name is ambiguous
+static struct named_file *find_named_file(char *entity) {
+	char *interned = find_interned(entity);
+	if (!interned || named_files_capacity == 0) {
+		return NULL;
+	}
+
+	struct named_file *entry = find_named_file_entry(interned);
+	if (!entry->entity) {
+		return NULL;
 	}
+
+	return entry;
 }
 
-static bool call_on_spawn(struct entity *entity, void *on_fns) {
-	switch (entity->type) {
-		case OBJECT_GUN: {
-			struct gun_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->spawn) {
-				// TODO: Print an error message about guns needing a sprite and such
-				assert(false);
-				return true;
-			}
-			cast_on_fns->spawn(entity->globals);
+// Only reads the index, so it can be called from on_tick() while ticking in parallel
+// Returns NULL after adding a message if there's no such entity
+static struct grug_file *get_entity_file(char *entity) {
+	struct named_file *entry = find_named_file(entity);
+
+	if (!entry) {
+		add_formatted_message("Won't spawn entity, as there is no entity named '%s'\n", entity);
+		return NULL;
+	}
+
+	if (entry->ambiguous) {
+		add_formatted_message("Won't spawn entity, as several mods have an entity named '%s', so it needs to be written as \"mod:%s\"\n", entity, entity);
+		return NULL;
+	}
+
+	return entry->file;
+}
+
+static u32 get_texture_index(char *path) {
+	u32 i = texture_buckets[hash_interned(path) % MAX_TEXTURES];
+
+	while (true) {
+		if (i == UINT32_MAX) {
 			break;
 		}
-		case OBJECT_BULLET: {
-			struct bullet_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->spawn) {
-				// TODO: Print an error message about bullets needing a sprite and such
-				assert(false);
-				return true;
-			}
-			cast_on_fns->spawn(entity->globals);
+
+		if (path == textures[i].path) {
 			break;
 		}
-		case OBJECT_BOX: {
-			struct box_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->spawn) {
-				// TODO: Print an error message about boxes needing a sprite and such
-				assert(false);
-				return true;
-			}
-			cast_on_fns->spawn(entity->globals);
-			break;
+
+		i = texture_chains[i];
+	}
+
+	return i;
+}
+
+static long long get_monotonic_ns(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * NANOSECONDS_PER_SECOND + time.tv_nsec;
+}
+
+// Textures are decoded by the decoder threads,
+// and the main thread only uploads them, within TEXTURE_UPLOAD_BUDGET_MS every frame
+// Until then the texture has an id of 0, which hides its entities, but already has its size,
+// so that the entities' shapes don't have to wait for it
+struct decode_job {
+	// Interned, so it stays valid
+	char *path;
+
+	u32 texture;
+	u32 generation;
+
+	u32 attempts;
+	long long due_ns;
+};
+
+// The image's data is NULL when it failed to decode MAX_DECODE_ATTEMPTS times
+struct decoded_image {
+	u32 texture;
+	u32 generation;
+	Image image;
+};
+
+static pthread_t texture_decoders[TEXTURE_DECODER_COUNT];
+
+// Guards everything below it
+static pthread_mutex_t decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_condition;
+static bool decoders_should_stop;
+
+static struct decode_job *decode_jobs;
+static size_t decode_jobs_size;
+static size_t decode_jobs_capacity;
+
+static struct decoded_image *decoded_images;
+static size_t decoded_images_size;
+static size_t decoded_images_capacity;
+
+// A copy of every texture's generation that the decoders can read,
+// so they can drop the jobs of textures that were released or reloaded in the meantime
+static u32 decode_generations[MAX_TEXTURES];
+
+// Has to be called with decode_mutex locked
+static void push_decode_job(struct decode_job job) {
+	if (decode_jobs_size >= decode_jobs_capacity) {
+		decode_jobs_capacity = decode_jobs_capacity == 0 ? INITIAL_DECODE_JOBS_CAPACITY : decode_jobs_capacity * 2;
+		decode_jobs = counted_realloc(MEMORY_COMMANDS, decode_jobs, decode_jobs_capacity * sizeof(*decode_jobs));
+		if (!decode_jobs) {
+			fprintf(stderr, "Failed to grow decode_jobs[] to %zu jobs\n", decode_jobs_capacity);
+			exit(EXIT_FAILURE);
 		}
-		case OBJECT_COUNTER: {
-			struct counter_on_fns *cast_on_fns = on_fns;
-			if (!cast_on_fns->spawn) {
-				// TODO: Print an error message about counters needing a name
-				assert(false);
-				return true;
-			}
+	}
+
+	decode_jobs[decode_jobs_size++] = job;
+
+	pthread_cond_signal(&decode_condition);
+}
+
+// Has to be called with decode_mutex locked
+static void push_decoded_image(struct decoded_image decoded) {
+	if (decoded_images_size >= decoded_images_capacity) {
+		decoded_images_capacity = decoded_images_capacity == 0 ? INITIAL_DECODE_JOBS_CAPACITY : decoded_images_capacity * 2;
+		decoded_images = counted_realloc(MEMORY_COMMANDS, decoded_images, decoded_images_capacity * sizeof(*decoded_images));
+		if (!decoded_images) {
+			fprintf(stderr, "Failed to grow decoded_images[] to %zu images\n", decoded_images_capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	decoded_images[decoded_images_size++] = decoded;
+}
+
+// Has to be called with decode_mutex locked
+static void drop_stale_decode_jobs(u32 texture) {
+	for (size_t i = 0; i < decode_jobs_size;) {
+		if (decode_jobs[i].texture == texture && decode_jobs[i].generation != decode_generations[texture]) {
+			decode_jobs[i] = decode_jobs[--decode_jobs_size];
+		} else {
+			i++;
+		}
+	}
+}
+
+static void queue_texture_decode(u32 texture, char *path, u32 generation) {
+	pthread_mutex_lock(&decode_mutex);
+	decode_generations[texture] = generation;
+	drop_stale_decode_jobs(texture);
+	push_decode_job((struct decode_job){
+		.path = path,
+		.texture = texture,
+		.generation = generation,
+	});
+	pthread_mutex_unlock(&decode_mutex);
+}
+
+// Stops the decoders from working on a texture that nobody uses anymore
+static void cancel_texture_decode(u32 texture, u32 generation) {
+	pthread_mutex_lock(&decode_mutex);
+	decode_generations[texture] = generation;
+	drop_stale_decode_jobs(texture);
+	pthread_mutex_unlock(&decode_mutex);
+}
+
+static void *run_texture_decoder(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&decode_mutex);
+
+	while (!decoders_should_stop) {
+		if (decode_jobs_size == 0) {
+			pthread_cond_wait(&decode_condition, &decode_mutex);
+			continue;
+		}
+
+		size_t earliest = 0;
+		for (size_t i = 1; i < decode_jobs_size; i++) {
+			if (decode_jobs[i].due_ns < decode_jobs[earliest].due_ns) {
+				earliest = i;
+			}
+		}
+
+		long long due_ns = decode_jobs[earliest].due_ns;
+		if (due_ns > get_monotonic_ns()) {
+			struct timespec until = {
+				.tv_sec = due_ns / NANOSECONDS_PER_SECOND,
+				.tv_nsec = due_ns % NANOSECONDS_PER_SECOND,
+			};
+			pthread_cond_timedwait(&decode_condition, &decode_mutex, &until);
+			continue;
+		}
+
+		struct decode_job job = decode_jobs[earliest];
+		decode_jobs[earliest] = decode_jobs[--decode_jobs_size];
+
+		pthread_mutex_unlock(&decode_mutex);
+		Image image = LoadImage(job.path);
+		pthread_mutex_lock(&decode_mutex);
+
+		job.attempts++;
+
+		// The texture was released or reloaded while it was being decoded
+		if (job.generation != decode_generations[job.texture]) {
+			UnloadImage(image);
+			continue;
+		}
+
+		if (image.data || job.attempts >= MAX_DECODE_ATTEMPTS) {
+			if (image.data && job.attempts > 1) {
+				fprintf(stderr, "The texture %s took %u attempts to decode successfully\n", job.path, job.attempts);
+			}
+
+			push_decoded_image((struct decoded_image){
+				.texture = job.texture,
+				.generation = job.generation,
+				.image = image,
+			});
+			continue;
+		}
+
+		// Backs off, instead of spinning on a file that an image editor is still writing
+		long long retry_ms = FIRST_DECODE_RETRY_MS << (job.attempts < 8 ? job.attempts - 1 : 7);
+		if (retry_ms > MAX_DECODE_RETRY_MS) {
+			retry_ms = MAX_DECODE_RETRY_MS;
+		}
+		job.due_ns = get_monotonic_ns() + retry_ms * 1000000;
+
+		push_decode_job(job);
+	}
+
+	pthread_mutex_unlock(&decode_mutex);
+
+	return NULL;
+}
+
+static void start_texture_decoders(void) {
+	// The due times are monotonic, so the condition has to wait on the monotonic clock too
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&decode_condition, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (size_t i = 0; i < TEXTURE_DECODER_COUNT; i++) {
+		if (pthread_create(&texture_decoders[i], NULL, run_texture_decoder, NULL)) {
+			fprintf(stderr, "pthread_create() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void stop_texture_decoders(void) {
+	pthread_mutex_lock(&decode_mutex);
+	decoders_should_stop = true;
+	pthread_cond_broadcast(&decode_condition);
+	pthread_mutex_unlock(&decode_mutex);
+
+	for (size_t i = 0; i < TEXTURE_DECODER_COUNT; i++) {
+		pthread_join(texture_decoders[i], NULL);
+	}
+
+	for (size_t i = 0; i < decoded_images_size; i++) {
+		UnloadImage(decoded_images[i].image);
+	}
+}
+
+// Reads the size out of the PNG's IHDR chunk, which is much cheaper than decoding the whole image
+// Returns whether that failed, like when the file isn't a PNG
+static bool read_png_size(char *path, int *width, int *height) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return true;
+	}
+
+	unsigned char header[24];
+	size_t read = fread(header, 1, sizeof(header), f);
+	fclose(f);
+
+	static unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if (read < sizeof(header) || memcmp(header, signature, sizeof(signature)) != 0 || memcmp(header + 12, "IHDR", 4) != 0) {
+		return true;
+	}
+
+	*width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+	*height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+
+	return *width <= 0 || *height <= 0;
+}
+
+#ifdef HEADLESS
+
+// There is no GPU to upload the texture to, so only the image's size is kept
+// The id is set to 1, so the texture still counts as having been loaded
+static Texture upload_texture(Image image) {
+	return (Texture){
+		.id = image.data ? 1 : 0,
+		.width = image.width,
+		.height = image.height,
+	};
+}
+
+static Texture load_texture(char *path) {
+	Image image = LoadImage(path);
+
+	Texture texture = upload_texture(image);
+
+	UnloadImage(image);
+
+	return texture;
+}
+
+static void unload_texture(Texture texture) {
+	(void)texture;
+}
+
+#else
+
+static Texture upload_texture(Image image) {
+	return LoadTextureFromImage(image);
+}
+
+static Texture load_texture(char *path) {
+	return LoadTexture(path);
+}
+
+static void unload_texture(Texture texture) {
+	UnloadTexture(texture);
+}
+
+#endif
+
+static u32 acquire_texture(char *path) {
+	path = intern(path);
+
+	u32 i = get_texture_index(path);
+
+	if (i == UINT32_MAX) {
+		if (textures_size >= MAX_TEXTURES) {
+			fprintf(stderr, "There are more than %d unique textures, exceeding MAX_TEXTURES\n", MAX_TEXTURES);
+			exit(EXIT_FAILURE);
+		}
+
+		i = textures_size++;
+
+		textures[i] = (struct texture_entry){0};
+		textures[i].path = path;
+
+		u32 bucket_index = hash_interned(path) % MAX_TEXTURES;
+		texture_chains[i] = texture_buckets[bucket_index];
+		texture_buckets[bucket_index] = i;
+	}
+
+	struct texture_entry *entry = &textures[i];
+
+	if (entry->ref_count == 0) {
+		int width;
+		int height;
+
+		if (read_png_size(entry->path, &width, &height)) {
+			// Only PNGs can be sized without decoding them, so anything else is loaded right away
+			entry->texture = load_texture(entry->path);
+			assert(entry->texture.id > 0);
+			loaded_textures++;
+		} else {
+			entry->texture = (Texture){.width = width, .height = height};
+			queue_texture_decode(i, entry->path, entry->generation);
+		}
+	}
+
+	entry->ref_count++;
+
+	return i;
+}
+
+static void release_texture(u32 i) {
+	struct texture_entry *entry = &textures[i];
+
+	assert(entry->ref_count > 0);
+	entry->ref_count--;
+
+	if (entry->ref_count == 0) {
+		// The texture can still be waiting to be decoded
+		if (entry->texture.id > 0) {
+			unload_texture(entry->texture);
+			loaded_textures--;
+		}
+		entry->texture = (Texture){0};
+		entry->generation++;
+		cancel_texture_decode(i, entry->generation);
+	}
+}
+
+static Texture get_entity_texture(struct entity *entity) {
+	return textures[entity->texture].texture;
+}
+
+static u32 get_sound_index(char *path) {
+	u32 i = sound_buckets[hash_interned(path) % MAX_SOUNDS];
+
+	while (true) {
+		if (i == UINT32_MAX) {
+			break;
+		}
+
+		if (path == sounds[i].path) {
+			break;
+		}
+
+		i = sound_chains[i];
+	}
+
+	return i;
+}
+
+// Sounds are never unloaded before the game closes,
+// so the memory used by sounds stays bounded by the number of unique .wav files
+static u32 load_sound(char *path) {
+	path = intern(path);
+
+	u32 i = get_sound_index(path);
+	if (i != UINT32_MAX) {
+		return i;
+	}
+
+	if (sounds_size >= MAX_SOUNDS) {
+		fprintf(stderr, "There are more than %d unique sounds, exceeding MAX_SOUNDS\n", MAX_SOUNDS);
+		exit(EXIT_FAILURE);
+	}
+
+	i = sounds_size++;
+
+	struct sound_entry *entry = &sounds[i];
+
+	entry->path = path;
+
+	// Headless builds don't have an audio device, so they only keep the path
+#ifndef HEADLESS
+	entry->sound = LoadSound(path);
+	assert(entry->sound.frameCount > 0);
+
+	for (size_t voice_index = 0; voice_index < VOICES_PER_SOUND; voice_index++) {
+		entry->voices[voice_index] = LoadSoundAlias(entry->sound);
+		entry->voice_volumes[voice_index] = 0.0f;
+	}
+#endif
+
+	u32 bucket_index = hash_interned(path) % MAX_SOUNDS;
+	sound_chains[i] = sound_buckets[bucket_index];
+	sound_buckets[bucket_index] = i;
+
+	return i;
+}
+
+#ifdef HEADLESS
+
+static void play_voice(u32 sound_index, float volume, float pitch, float pan) {
+	(void)sound_index;
+	(void)volume;
+	(void)pitch;
+	(void)pan;
+}
+
+#else
+
+static u64 voices_played;
+
+// Plays the sound on an idle voice
+// If all voices are busy, the quietest voice gets stolen, where a tie steals the oldest one,
+// unless every voice is louder than the new sound
+static void play_voice(u32 sound_index, float volume, float pitch, float pan) {
+	struct sound_entry *entry = &sounds[sound_index];
+
+	size_t chosen = SIZE_MAX;
+
+	for (size_t i = 0; i < VOICES_PER_SOUND; i++) {
+		if (!IsSoundPlaying(entry->voices[i])) {
+			chosen = i;
+			break;
+		}
+
+		if (entry->voice_volumes[i] > volume) {
+			continue;
+		}
+
+		if (chosen == SIZE_MAX || entry->voice_volumes[i] < entry->voice_volumes[chosen]) {
+			chosen = i;
+		} else if (entry->voice_volumes[i] == entry->voice_volumes[chosen] && entry->voice_play_counts[i] < entry->voice_play_counts[chosen]) {
+			chosen = i;
+		}
+	}
+
+	if (chosen == SIZE_MAX) {
+		return;
+	}
+
+	Sound voice = entry->voices[chosen];
+
+	StopSound(voice);
+
+	SetSoundVolume(voice, volume);
+	SetSoundPitch(voice, pitch);
+	SetSoundPan(voice, pan);
+
+	PlaySound(voice);
+
+	entry->voice_volumes[chosen] = volume;
+	entry->voice_play_counts[chosen] = voices_played++;
+}
+
+static size_t get_active_voice_count(void) {
+	size_t count = 0;
+
+	for (size_t i = 0; i < sounds_size; i++) {
+		for (size_t voice_index = 0; voice_index < VOICES_PER_SOUND; voice_index++) {
+			if (IsSoundPlaying(sounds[i].voices[voice_index])) {
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+#endif
+
+// Returns the entry of the key, or the empty entry where the key should be inserted
+// The key has to be interned
+static struct i32_map_entry *find_i32_map_entry(struct i32_map *map, char *key) {
+	size_t mask = map->capacity - 1;
+
+	for (size_t i = hash_interned(key) & mask;; i = (i + 1) & mask) {
+		struct i32_map_entry *entry = &map->entries[i];
+
+		if (!entry->key || entry->key == key) {
+			return entry;
+		}
+	}
+}
+
+static void grow_i32_map(struct i32_map *map) {
+	struct i32_map_entry *old_entries = map->entries;
+	size_t old_capacity = map->capacity;
+
+	map->capacity = old_capacity == 0 ? INITIAL_I32_MAP_CAPACITY : old_capacity * 2;
+
+	map->entries = counted_calloc(MEMORY_I32_MAPS, map->capacity, sizeof(*map->entries));
+	if (!map->entries) {
+		fprintf(stderr, "Failed to grow an i32 map to %zu entries\n", map->capacity);
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < old_capacity; i++) {
+		struct i32_map_entry old_entry = old_entries[i];
+
+		if (old_entry.key) {
+			*find_i32_map_entry(map, old_entry.key) = old_entry;
+		}
+	}
+
+	counted_free(old_entries);
+}
+
+// Empties the map, but keeps its entries allocated
+static void clear_i32_map(struct i32_map *map) {
+	if (map->entries) {
+		memset(map->entries, 0, map->capacity * sizeof(*map->entries));
+	}
+	map->size = 0;
+}
+
+static void free_i32_map(struct i32_map *map) {
+	counted_free(map->entries);
+
+	*map = (struct i32_map){0};
+}
+
+void game_fn_map_set_i32(u64 id, char *key, i32 value) {
+	// The key string stays valid until the tick's buffers are merged, since mods are only reloaded between ticks
+	if (tick_buffer) {
+		push_tick_command(TICK_COMMAND_MAP_SET_I32)->map_set_i32 = (struct tick_map_set_i32){ .id = id, .key = key, .value = value };
+		return;
+	}
+
+	size_t entity_index = get_entity_index_from_entity_id(id);
+	if (entity_index == SIZE_MAX) {
+		return;
+	}
+
+	struct i32_map *map = &entity_colds[entity_index].i32_map;
+
+	key = intern(key);
+
+	if (map->size > 0) {
+		struct i32_map_entry *entry = find_i32_map_entry(map, key);
+
+		if (entry->key) {
+			entry->value = value;
+			return;
+		}
+	}
+
+	if (map->size >= MAX_I32_MAP_ENTRIES) {
+		snprintf(message, sizeof(message), "The i32 map of the entity with ID %ld has %d entries, which exceeds MAX_I32_MAP_ENTRIES\n", id, MAX_I32_MAP_ENTRIES);
+		add_message();
+
+		return;
+	}
+
+	// Keeps the load factor at or below 0.5
+	if ((map->size + 1) * 2 > map->capacity) {
+		grow_i32_map(map);
+	}
+
+	struct i32_map_entry *entry = find_i32_map_entry(map, key);
+
+	entry->key = key;
+	entry->value = value;
+
+	map->size++;
+}
+
+// During a parallel tick, the map writes of other entities only become visible after the tick,
+// but an on_tick() does see its own writes
+// Returns NULL if the running on_tick() didn't write the key
+static struct tick_map_set_i32 *find_tick_map_set_i32(u64 id, char *key) {
+	for (size_t i = tick_buffer->commands_size; i > tick_buffer->entity_commands_start; i--) {
+		struct tick_command *command = &tick_buffer->commands[i - 1];
+
+		if (command->type == TICK_COMMAND_MAP_SET_I32 && command->map_set_i32.id == id && streq(command->map_set_i32.key, key)) {
+			return &command->map_set_i32;
+		}
+	}
+
+	return NULL;
+}
+
+i32 game_fn_map_get_i32(u64 id, char *key) {
+	if (tick_buffer) {
+		struct tick_map_set_i32 *set = find_tick_map_set_i32(id, key);
+		if (set) {
+			return set->value;
+		}
+	}
+
+	size_t entity_index = get_entity_index_from_entity_id(id);
+	if (entity_index == SIZE_MAX) {
+		return -1;
+	}
+
+	struct i32_map *map = &entity_colds[entity_index].i32_map;
+
+	if (map->size == 0) {
+		add_formatted_message("The i32 map of the entity with ID %ld is empty, so can't contain the key '%s'\n", id, key);
+
+		return -1;
+	}
+
+	// A key that was never interned can't be in any map
+	char *interned_key = find_interned(key);
+
+	struct i32_map_entry *entry = interned_key ? find_i32_map_entry(map, interned_key) : NULL;
+
+	if (!entry || !entry->key) {
+		add_formatted_message("The i32 map of the entity with ID %ld doesn't contain the key '%s'\n", id, key);
+
+		return -1;
+	}
+
+	return entry->value;
+}
+
+bool game_fn_map_has_i32(u64 id, char *key) {
+	if (tick_buffer && find_tick_map_set_i32(id, key)) {
+		return true;
+	}
+
+	size_t entity_index = get_entity_index_from_entity_id(id);
+	if (entity_index == SIZE_MAX) {
+		return false;
+	}
+
+	struct i32_map *map = &entity_colds[entity_index].i32_map;
+
+	if (map->size == 0) {
+		return false;
+	}
+
+	// A key that was never interned can't be in any map
+	char *interned_key = find_interned(key);
+
+	return interned_key && find_i32_map_entry(map, interned_key)->key;
+}
+
+void game_fn_play_sound(char *path) {
+	if (tick_buffer) {
+		push_tick_command(TICK_COMMAND_PLAY_SOUND)->sound_path = path;
+		return;
+	}
+
+	play_voice(load_sound(path), 1.0f, 1.0f, 0.5f);
+}
+
+void game_fn_print_bool(bool b) {
+	add_formatted_message("%s\n", b ? "true" : "false");
+}
+
+void game_fn_print_string(char *s) {
+	add_formatted_message("%s\n", s);
+}
+
+void game_fn_print_f32(float f) {
+	add_formatted_message("%f\n", f);
+}
+
+void game_fn_print_i32(i32 i) {
+	add_formatted_message("%d\n", i);
+}
+
+float game_fn_rand(float min, float max) {
+    float range = max - min;
+
+    // Every range of a parallel tick has its own seed, so the numbers don't depend on the order the workers run in
+    int random = tick_buffer ? rand_r(&tick_buffer->rand_seed) : rand();
+
+    return min + random / (double)RAND_MAX * range;
+}
+
+static b2BodyDef get_bullet_body_def(b2Vec2 muzzle_pos, float angle_in_degrees, float velocity_in_meters_per_second) {
+	b2Rot rot = b2Body_GetRotation(gun->body_id);
+	double gun_angle = b2Rot_GetAngle(rot);
+	double added_angle = angle_in_degrees * DEG2RAD;
+	bool facing_left = (gun_angle > PI / 2) || (gun_angle < -PI / 2);
+	rot = b2MakeRot(gun_angle + added_angle * (facing_left ? -1 : 1));
+
+	b2Vec2 velocity_unrotated = (b2Vec2){.x=velocity_in_meters_per_second * PIXELS_PER_METER, .y=0};
+	b2Vec2 velocity = b2RotateVector(rot, velocity_unrotated);
+
+	b2BodyDef body_def = b2DefaultBodyDef();
+
+	body_def.type = b2_dynamicBody;
+	body_def.position = muzzle_pos;
+	body_def.rotation = b2MakeRot(gun_angle);
+	body_def.linearVelocity = velocity;
+
+	return body_def;
+}
+
+static char *get_texture_path(struct entity *entity) {
+	switch (entity->type) {
+		case OBJECT_GUN:
+			return gun_on_spawn_data.sprite_path;
+		case OBJECT_BULLET:
+			return bullet_on_spawn_data.sprite_path;
+		case OBJECT_BOX:
+			return box_on_spawn_data.sprite_path;
+		case OBJECT_COUNTER:
+			break;
+	}
+	assert(false);
+}
+
+static b2Vec2 get_bullet_muzzle_pos(struct entity *entity, float x, float y) {
+	b2Vec2 local_point = {
+		.x = get_entity_texture(gun).width / 2.0f + get_entity_texture(entity).width / 2.0f + x,
+		.y = y
+	};
+
+	return b2Body_GetWorldPoint(gun->body_id, local_point);
+}
+
+static u32 get_mod_cost_index(struct grug_file *file) {
+	char *entity = intern(file->entity);
+
+	for (u32 i = 0; i < mod_costs_size; i++) {
+		if (mod_costs[i].entity == entity) {
+			return i;
+		}
+	}
+
+	if (mod_costs_size >= MAX_MOD_COSTS) {
+		fprintf(stderr, "There are more than %d mods with entities, exceeding MAX_MOD_COSTS\n", MAX_MOD_COSTS);
+		exit(EXIT_FAILURE);
+	}
+
+	struct mod_cost *cost = &mod_costs[mod_costs_size];
+	cost->entity = entity;
+	cost->file_name = intern(file->name);
+
+	return mod_costs_size++;
+}
+
+static long long get_mod_cost_total_ns(struct mod_cost *cost) {
+	return atomic_load(&cost->ns[0]) + atomic_load(&cost->ns[1]);
+}
+
+// Returns 0 if the mod's on_fns weren't called in the mode
+static double get_mod_cost_us_per_call(struct mod_cost *cost, size_t mode) {
+	long long calls = atomic_load(&cost->calls[mode]);
+	return calls > 0 ? atomic_load(&cost->ns[mode]) / 1.0e3 / calls : 0.0;
+}
+
+static void add_mod_cost(u32 mod_cost_index, long long calls, long long ns) {
+	struct mod_cost *cost = &mod_costs[mod_cost_index];
+	size_t mode = grug_are_on_fns_in_safe_mode();
+
+	atomic_fetch_add(&cost->calls[mode], calls);
+	atomic_fetch_add(&cost->ns[mode], ns);
+}
+
+static void dispatch_on_despawn(struct entity *entity, void *on_fns) {
+	switch (entity->type) {
+		case OBJECT_GUN: {
+			struct gun_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->despawn) {
+				break;
+			}
+			cast_on_fns->despawn(entity->globals);
+			break;
+		}
+		case OBJECT_BULLET: {
+			struct bullet_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->despawn) {
+				break;
+			}
+			cast_on_fns->despawn(entity->globals);
+			break;
+		}
+		case OBJECT_BOX: {
+			struct box_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->despawn) {
+				break;
+			}
+			cast_on_fns->despawn(entity->globals);
+			break;
+		}
+		case OBJECT_COUNTER: {
+			struct counter_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->despawn) {
+				break;
+			}
+			cast_on_fns->despawn(entity->globals);
+			break;
+		}
+	}
+}
+
+static void call_on_despawn(struct entity *entity, void *on_fns) {
+	u32 mod_cost = get_cold(entity)->mod_cost;
+
+	long long start_ns = get_monotonic_ns();
+	dispatch_on_despawn(entity, on_fns);
+	add_mod_cost(mod_cost, 1, get_monotonic_ns() - start_ns);
+}
+
+// Returns the slab of the file's .so, creating it if it doesn't exist yet
+// Exits if that would exceed MAX_GLOBALS_SLABS
+static struct globals_slab *get_globals_slab(struct grug_file *file) {
+	for (size_t i = 0; i < globals_slabs_size; i++) {
+		if (globals_slabs[i]->dll == file->dll) {
+			return globals_slabs[i];
+		}
+	}
+
+	if (globals_slabs_size >= MAX_GLOBALS_SLABS) {
+		fprintf(stderr, "There are more than %d globals slabs, exceeding MAX_GLOBALS_SLABS\n", MAX_GLOBALS_SLABS);
+		exit(EXIT_FAILURE);
+	}
+
+	struct globals_slab *slab = counted_calloc(MEMORY_GLOBALS, 1, sizeof(*slab));
+	if (!slab) {
+		fprintf(stderr, "Failed to allocate a globals slab\n");
+		exit(EXIT_FAILURE);
+	}
+
+	slab->dll = file->dll;
+
+	// A free block has to be able to hold the free list's next pointer
+	size_t size = file->globals_size > sizeof(void *) ? file->globals_size : sizeof(void *);
+	slab->stride = (size + GLOBALS_ALIGNMENT - 1) / GLOBALS_ALIGNMENT * GLOBALS_ALIGNMENT;
+
+	globals_slabs[globals_slabs_size++] = slab;
+
+	return slab;
+}
+
+static void *allocate_globals(struct globals_slab *slab) {
+	slab->live++;
+
+	if (slab->free_list) {
+		void *globals = slab->free_list;
+		slab->free_list = *(void **)globals;
+		return globals;
+	}
+
+	if (slab->chunks_size == 0 || slab->used_in_last_chunk == GLOBALS_PER_CHUNK) {
+		if (slab->chunks_size >= slab->chunks_capacity) {
+			slab->chunks_capacity = slab->chunks_capacity == 0 ? INITIAL_GLOBALS_CHUNKS_CAPACITY : slab->chunks_capacity * 2;
+			slab->chunks = counted_realloc(MEMORY_GLOBALS, slab->chunks, slab->chunks_capacity * sizeof(*slab->chunks));
+			if (!slab->chunks) {
+				fprintf(stderr, "Failed to grow a globals slab to %zu chunks\n", slab->chunks_capacity);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		char *chunk = counted_aligned_alloc(MEMORY_GLOBALS, GLOBALS_PER_CHUNK * slab->stride, GLOBALS_ALIGNMENT);
+		if (!chunk) {
+			fprintf(stderr, "Failed to allocate a globals chunk of %zu bytes\n", GLOBALS_PER_CHUNK * slab->stride);
+			exit(EXIT_FAILURE);
+		}
+
+		slab->chunks[slab->chunks_size++] = chunk;
+		slab->used_in_last_chunk = 0;
+	}
+
+	return slab->chunks[slab->chunks_size - 1] + slab->used_in_last_chunk++ * slab->stride;
+}
+
+static void destroy_globals_slab(struct globals_slab *slab) {
+	for (size_t i = 0; i < slab->chunks_size; i++) {
+		counted_free(slab->chunks[i]);
+	}
+	counted_free(slab->chunks);
+	counted_free(slab);
+}
+
+static void free_globals(struct globals_slab *slab, void *globals) {
+	assert(slab->live > 0);
+	slab->live--;
+
+	if (slab->detached && slab->live == 0) {
+		destroy_globals_slab(slab);
+		return;
+	}
+
+	*(void **)globals = slab->free_list;
+	slab->free_list = globals;
+}
+
+// Makes the next entity of the reloaded .so get a new slab,
+// since the new .so can have a different globals_size, and can be loaded at the same address
+// The entities that still have globals from the old slab free them while they're being reloaded
+static void detach_globals_slab(void *dll) {
+	for (size_t i = 0; i < globals_slabs_size; i++) {
+		struct globals_slab *slab = globals_slabs[i];
+
+		if (slab->dll != dll) {
+			continue;
+		}
+
+		globals_slabs[i] = globals_slabs[--globals_slabs_size];
+
+		if (slab->live == 0) {
+			destroy_globals_slab(slab);
+		} else {
+			slab->detached = true;
+		}
+
+		return;
+	}
+}
+
+// Returns NULL if there are already MAX_BULLET_POOLS pools
+static struct bullet_pool *get_bullet_pool(void *dll) {
+	for (size_t i = 0; i < bullet_pools_size; i++) {
+		if (bullet_pools[i].dll == dll) {
+			return &bullet_pools[i];
+		}
+	}
+
+	if (bullet_pools_size >= MAX_BULLET_POOLS) {
+		return NULL;
+	}
+
+	struct bullet_pool *pool = &bullet_pools[bullet_pools_size++];
+	*pool = (struct bullet_pool){ .dll = dll };
+	return pool;
+}
+
+// Returns whether the bullet got parked, in which case its body and globals mustn't be freed
+static bool park_bullet(size_t entity_index) {
+	struct entity *entity = &entities[entity_index];
+	struct entity_cold *cold = &entity_colds[entity_index];
+
+	struct bullet_pool *pool = get_bullet_pool(cold->dll);
+	if (!pool) {
+		return false;
+	}
+
+	if (pool->size >= pool->capacity) {
+		pool->capacity = pool->capacity == 0 ? INITIAL_BULLET_POOL_CAPACITY : pool->capacity * 2;
+		pool->parked = counted_realloc(MEMORY_BULLET_POOLS, pool->parked, pool->capacity * sizeof(*pool->parked));
+		if (!pool->parked) {
+			fprintf(stderr, "Failed to grow a bullet pool to %zu bullets\n", pool->capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// A disabled body is removed from the broadphase and the solver, but keeps its shape
+	b2Body_Disable(entity->body_id);
+
+	pool->parked[pool->size++] = (struct parked_bullet){
+		.body_id = entity->body_id,
+		.shape_id = cold->shape_id,
+		.globals = entity->globals,
+		.globals_slab = cold->globals_slab,
+		.i32_map = cold->i32_map,
+		.texture = entity->texture,
+		.density = cold->bullet.density,
+		.width = get_entity_texture(entity).width,
+		.height = get_entity_texture(entity).height,
+	};
+
+	return true;
+}
+
+// Returns whether a parked bullet was taken out of the pool
+static bool unpark_bullet(void *dll, struct parked_bullet *parked) {
+	for (size_t i = 0; i < bullet_pools_size; i++) {
+		struct bullet_pool *pool = &bullet_pools[i];
+
+		if (pool->dll == dll) {
+			if (pool->size == 0) {
+				return false;
+			}
+
+			*parked = pool->parked[--pool->size];
+
+			if (pool->size < pool->low_water_size) {
+				pool->low_water_size = pool->size;
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void destroy_parked_bullet(struct parked_bullet *parked) {
+	b2DestroyBody(parked->body_id);
+	release_texture(parked->texture);
+	free_globals(parked->globals_slab, parked->globals);
+	free_i32_map(&parked->i32_map);
+}
+
+// Frees the parked bullets of a .so that got reloaded, since their globals have the old size
+static void empty_bullet_pool(void *dll) {
+	for (size_t i = 0; i < bullet_pools_size; i++) {
+		struct bullet_pool *pool = &bullet_pools[i];
+
+		if (pool->dll != dll) {
+			continue;
+		}
+
+		for (size_t parked_index = 0; parked_index < pool->size; parked_index++) {
+			destroy_parked_bullet(&pool->parked[parked_index]);
+		}
+
+		counted_free(pool->parked);
+
+		bullet_pools[i] = bullet_pools[--bullet_pools_size];
+
+		return;
+	}
+}
+
+// Destroys the parked bullets that stayed unused for BULLET_POOL_TRIM_TICKS,
+// so that a single burst of shots doesn't keep thousands of disabled bodies in the world
+static void trim_bullet_pools(void) {
+	if (++ticks_since_bullet_pool_trim < BULLET_POOL_TRIM_TICKS) {
+		return;
+	}
+	ticks_since_bullet_pool_trim = 0;
+
+	for (size_t i = 0; i < bullet_pools_size; i++) {
+		struct bullet_pool *pool = &bullet_pools[i];
+
+		size_t unused = pool->low_water_size;
+
+		for (size_t parked_index = 0; parked_index < unused; parked_index++) {
+			destroy_parked_bullet(&pool->parked[parked_index]);
+		}
+
+		pool->size -= unused;
+		memmove(pool->parked, pool->parked + unused, pool->size * sizeof(*pool->parked));
+
+		pool->low_water_size = pool->size;
+	}
+}
+
+// Returns the index the id was added at
+static u32 push_entity_list(struct entity_list *list, u64 id) {
+	if (list->size >= list->capacity) {
+		list->capacity = list->capacity == 0 ? INITIAL_ENTITY_LIST_CAPACITY : list->capacity * 2;
+		list->ids = counted_realloc(MEMORY_ENTITY_LISTS, list->ids, list->capacity * sizeof(*list->ids));
+		if (!list->ids) {
+			fprintf(stderr, "Failed to grow an entity list to %zu entities\n", list->capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	list->ids[list->size] = id;
+	return list->size++;
+}
+
+// Swap-removes the id at index i, and returns the cold data of the entity that got moved into its place, if any
+static struct entity_cold *remove_from_entity_list(struct entity_list *list, u32 i) {
+	list->size--;
+	list->ids[i] = list->ids[list->size];
+
+	if (i < list->size) {
+		return &entity_colds[find_entity_index(list->ids[i])];
+	}
+	return NULL;
+}
+
+static struct entity_list *get_dll_entities(void *dll) {
+	for (size_t i = 0; i < dll_entities_size; i++) {
+		if (dll_entities[i].dll == dll) {
+			return &dll_entities[i].entities;
+		}
+	}
+
+	if (dll_entities_size >= MAX_DLL_ENTITIES) {
+		fprintf(stderr, "There are more than %d .so files with entities, exceeding MAX_DLL_ENTITIES\n", MAX_DLL_ENTITIES);
+		exit(EXIT_FAILURE);
+	}
+
+	dll_entities[dll_entities_size] = (struct dll_entities){.dll = dll};
+
+	return &dll_entities[dll_entities_size++].entities;
+}
+
+static void add_to_dll_entities(struct entity *entity) {
+	struct entity_cold *cold = get_cold(entity);
+	cold->dll_index = push_entity_list(get_dll_entities(cold->dll), entity->id);
+}
+
+static void remove_from_dll_entities(struct entity *entity) {
+	struct entity_cold *cold = get_cold(entity);
+
+	if (cold->dll_index == UINT32_MAX) {
+		return;
+	}
+
+	struct entity_cold *moved = remove_from_entity_list(get_dll_entities(cold->dll), cold->dll_index);
+	if (moved) {
+		moved->dll_index = cold->dll_index;
+	}
+
+	cold->dll_index = UINT32_MAX;
+}
+
+// Takes the entities of a reloaded .so out of the index, which the caller then has to free
+// It's taken out before any of them get reloaded, since the new .so can be loaded at the same address
+static struct entity_list take_dll_entities(void *dll) {
+	for (size_t i = 0; i < dll_entities_size; i++) {
+		if (dll_entities[i].dll != dll) {
+			continue;
+		}
+
+		struct entity_list list = dll_entities[i].entities;
+
+		for (size_t id_index = 0; id_index < list.size; id_index++) {
+			entity_colds[find_entity_index(list.ids[id_index])].dll_index = UINT32_MAX;
+		}
+
+		dll_entities[i] = dll_entities[--dll_entities_size];
+
+		return list;
+	}
+
+	return (struct entity_list){0};
+}
+
+static void add_to_texture_users(struct entity *entity) {
+	get_cold(entity)->texture_index = push_entity_list(&textures[entity->texture].users, entity->id);
+}
+
+static void remove_from_texture_users(struct entity *entity) {
+	struct entity_cold *cold = get_cold(entity);
+
+	if (cold->texture_index == UINT32_MAX) {
+		return;
+	}
+
+	struct entity_cold *moved = remove_from_entity_list(&textures[entity->texture].users, cold->texture_index);
+	if (moved) {
+		moved->texture_index = cold->texture_index;
+	}
+
+	cold->texture_index = UINT32_MAX;
+}
+
+static void add_to_tick_group(struct entity *entity) {
+	void (*tick)(void *globals) = NULL;
+
+	if (entity->type == OBJECT_BULLET) {
+		tick = ((struct bullet_on_fns *)entity->on_fns)->tick;
+	} else if (entity->type == OBJECT_COUNTER) {
+		tick = ((struct counter_on_fns *)entity->on_fns)->tick;
+	}
+
+	if (!tick) {
+		return;
+	}
+
+	struct entity_cold *cold = get_cold(entity);
+
+	u32 group_index = 0;
+	while (group_index < tick_groups_size && tick_groups[group_index].dll != cold->dll) {
+		group_index++;
+	}
+
+	if (group_index == tick_groups_size) {
+		if (tick_groups_size >= MAX_TICK_GROUPS) {
+			fprintf(stderr, "There are more than %d tick groups, exceeding MAX_TICK_GROUPS\n", MAX_TICK_GROUPS);
+			exit(EXIT_FAILURE);
+		}
+
+		tick_groups[tick_groups_size++] = (struct tick_group){ .dll = cold->dll, .tick = tick, .mod_cost = cold->mod_cost };
+	}
+
+	struct tick_group *group = &tick_groups[group_index];
+
+	if (group->size >= group->capacity) {
+		group->capacity = group->capacity == 0 ? INITIAL_TICK_GROUP_CAPACITY : group->capacity * 2;
+		group->globals = counted_realloc(MEMORY_TICK_GROUPS, group->globals, group->capacity * sizeof(*group->globals));
+		group->ids = counted_realloc(MEMORY_TICK_GROUPS, group->ids, group->capacity * sizeof(*group->ids));
+		if (!group->globals || !group->ids) {
+			fprintf(stderr, "Failed to grow a tick group to %zu entities\n", group->capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	cold->tick_group = group_index;
+	cold->tick_index = group->size;
+
+	group->globals[group->size] = entity->globals;
+	group->ids[group->size] = entity->id;
+	group->size++;
+}
+
+static void remove_from_tick_group(struct entity *entity) {
+	struct entity_cold *cold = get_cold(entity);
+
+	if (cold->tick_group == UINT32_MAX) {
+		return;
+	}
+
+	struct tick_group *group = &tick_groups[cold->tick_group];
+	u32 i = cold->tick_index;
+
+	group->size--;
+	group->globals[i] = group->globals[group->size];
+	group->ids[i] = group->ids[group->size];
+
+	if (i < group->size) {
+		entity_colds[find_entity_index(group->ids[i])].tick_index = i;
+	}
+
+	cold->tick_group = UINT32_MAX;
+}
+
+// Empty groups are kept around, so bursts of bullets don't keep reallocating them,
+// but the group of a reloaded .so is freed, since its tick function was unloaded
+static void remove_tick_group(void *dll) {
+	for (u32 group_index = 0; group_index < tick_groups_size; group_index++) {
+		struct tick_group *group = &tick_groups[group_index];
+
+		if (group->dll != dll) {
+			continue;
+		}
+
+		assert(group->size == 0);
+
+		counted_free(group->globals);
+		counted_free(group->ids);
+
+		tick_groups_size--;
+		tick_groups[group_index] = tick_groups[tick_groups_size];
+
+		// The members of the group that got moved need to point to its new index
+		if (group_index < tick_groups_size) {
+			for (size_t i = 0; i < group->size; i++) {
+				entity_colds[find_entity_index(group->ids[i])].tick_group = group_index;
+			}
+		}
+
+		return;
+	}
+}
+
+// Frees everything the entity owns, and swap-removes it, without calling its on_despawn()
+// Bullets with a body get parked in their pool instead
+static void remove_entity(size_t entity_index) {
+	remove_from_tick_group(&entities[entity_index]);
+	remove_from_dll_entities(&entities[entity_index]);
+	remove_from_texture_users(&entities[entity_index]);
+
+	bool parked = entities[entity_index].type == OBJECT_BULLET && entities[entity_index].texture != UINT32_MAX && park_bullet(entity_index);
+
+	if (!parked) {
+		if (entities[entity_index].texture != UINT32_MAX) {
+			release_texture(entities[entity_index].texture);
+
+			b2DestroyBody(entities[entity_index].body_id);
+		}
+
+		free_globals(entity_colds[entity_index].globals_slab, entities[entity_index].globals);
+
+		free_i32_map(&entity_colds[entity_index].i32_map);
+	}
+
+	free_entity_slot(entities[entity_index].id);
+
+	entities_size--;
+	entities[entity_index] = entities[entities_size];
+	entity_colds[entity_index] = entity_colds[entities_size];
+
+	// If the removed entity wasn't at the very end of the entities array,
+	// the entity that got moved into its place needs its slot to point to its new index
+	if (entity_index < entities_size) {
+		entity_slots[get_entity_slot_index(entities[entity_index].id)].entity_index = entity_index;
+
+		if (entities[entity_index].type == OBJECT_GUN) {
+			gun = entities + entity_index;
+		}
+	}
+}
+
+static void queue_despawn(u64 id) {
+	size_t entity_index = find_entity_index(id);
+	if (entity_index == SIZE_MAX || entity_colds[entity_index].despawn_queued) {
+		return;
+	}
+	entity_colds[entity_index].despawn_queued = true;
+
+	if (despawn_queue_size >= despawn_queue_capacity) {
+		despawn_queue_capacity = despawn_queue_capacity == 0 ? INITIAL_DESPAWN_QUEUE_CAPACITY : despawn_queue_capacity * 2;
+		despawn_queue = counted_realloc(MEMORY_COMMANDS, despawn_queue, despawn_queue_capacity * sizeof(*despawn_queue));
+		if (!despawn_queue) {
+			fprintf(stderr, "Failed to grow despawn_queue[] to %zu IDs\n", despawn_queue_capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	despawn_queue[despawn_queue_size++] = id;
+}
+
+// Calls every on_despawn() first, and only then removes the entities in one go,
+// so removing them doesn't get interleaved with mod code
+// This is O(queued entities), rather than O(entities)
+static void drain_despawn_queue(void) {
+	// on_despawn() can queue more despawns, so despawn_queue_size is reread every iteration
+	for (size_t i = 0; i < despawn_queue_size; i++) {
+		size_t entity_index = find_entity_index(despawn_queue[i]);
+
+		// An earlier on_despawn() may have despawned it already
+		if (entity_index != SIZE_MAX) {
+			struct entity *entity = &entities[entity_index];
+			call_on_despawn(entity, entity->on_fns);
+		}
+	}
+
+	for (size_t i = 0; i < despawn_queue_size; i++) {
+		size_t entity_index = find_entity_index(despawn_queue[i]);
+
+		if (entity_index != SIZE_MAX) {
+			remove_entity(entity_index);
+		}
+	}
+
+	despawn_queue_size = 0;
+}
+
+// Whether the ID was handed out by a spawn in the running range of a parallel tick,
+// in which case the entity only gets created when the tick's buffers are merged
+static bool is_spawned_by_tick_range(u64 id) {
+	for (size_t i = 0; i < tick_buffer->used_reserved_slots; i++) {
+		if (get_entity_id(tick_buffer->reserved_slots[i]) == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Deferred, since the caller may be iterating entities[], or be the entity itself
+void game_fn_despawn_entity(u64 id) {
+	// Merging applies the spawn before the despawn, so the entity exists by then
+	if (tick_buffer && is_spawned_by_tick_range(id)) {
+		push_tick_command(TICK_COMMAND_DESPAWN)->despawn_id = id;
+		return;
+	}
+
+	if (get_entity_index_from_entity_id(id) != SIZE_MAX) {
+		if (tick_buffer) {
+			push_tick_command(TICK_COMMAND_DESPAWN)->despawn_id = id;
+		} else {
+			queue_despawn(id);
+		}
+	}
+}
+
+static void write_on_spawn_data_to_entity(struct entity *entity) {
+	struct entity_cold *cold = get_cold(entity);
+
+	switch (entity->type) {
+		case OBJECT_GUN:
+			cold->gun.ms_per_round_fired = gun_on_spawn_data.ms_per_round_fired;
+			break;
+		case OBJECT_BULLET:
+			cold->bullet.density = bullet_on_spawn_data.density;
+			break;
+		case OBJECT_BOX:
+			cold->box.sprite_path = intern(box_on_spawn_data.sprite_path);
+			break;
+		case OBJECT_COUNTER:
+			break;
+	}
+}
+
+static bool dispatch_on_spawn(struct entity *entity, void *on_fns) {
+	switch (entity->type) {
+		case OBJECT_GUN: {
+			struct gun_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->spawn) {
+				// TODO: Print an error message about guns needing a sprite and such
+				assert(false);
+				return true;
+			}
+			cast_on_fns->spawn(entity->globals);
+			break;
+		}
+		case OBJECT_BULLET: {
+			struct bullet_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->spawn) {
+				// TODO: Print an error message about bullets needing a sprite and such
+				assert(false);
+				return true;
+			}
+			cast_on_fns->spawn(entity->globals);
+			break;
+		}
+		case OBJECT_BOX: {
+			struct box_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->spawn) {
+				// TODO: Print an error message about boxes needing a sprite and such
+				assert(false);
+				return true;
+			}
+			cast_on_fns->spawn(entity->globals);
+			break;
+		}
+		case OBJECT_COUNTER: {
+			struct counter_on_fns *cast_on_fns = on_fns;
+			if (!cast_on_fns->spawn) {
+				// TODO: Print an error message about counters needing a name
+				assert(false);
+				return true;
+			}
 			cast_on_fns->spawn(entity->globals);
 			break;
 		}
 	}
 
-	return false;
+	return false;
+}
+
+static bool call_on_spawn(struct entity *entity, void *on_fns) {
+	// Read up front, since on_spawn() can move the entity
+	u32 mod_cost = get_cold(entity)->mod_cost;
+
+	long long start_ns = get_monotonic_ns();
+	bool failed = dispatch_on_spawn(entity, on_fns);
+	add_mod_cost(mod_cost, 1, get_monotonic_ns() - start_ns);
+
+	return failed;
+}
+
+// Allocates the entity and its globals, but doesn't call its on_spawn() yet
+// The slot is freed if the entity can't be created
+static struct entity *create_entity_in_slot(u32 slot_index, enum entity_type type, struct grug_file *file) {
+	if (entities_size >= max_entities) {
+		snprintf(message, sizeof(message), "Won't spawn entity, as there are already %zu entities, exceeding max_entities\n", max_entities);
+		add_message();
+
+		free_entity_slot(get_entity_id(slot_index));
+
+		return NULL;
+	}
+
+	if (entities_size >= entities_capacity) {
+		grow_entities();
+	}
+
+	size_t entity_index = entities_size++;
+	struct entity *entity = &entities[entity_index];
+	struct entity_cold *cold = &entity_colds[entity_index];
+
+	*entity = (struct entity){0};
+	*cold = (struct entity_cold){0};
+
+	entity_slots[slot_index].entity_index = entity_index;
+	entity->id = get_entity_id(slot_index);
+
+	cold->dll = file->dll;
+	cold->mod_cost = get_mod_cost_index(file);
+
+	struct parked_bullet parked;
+	if (type == OBJECT_BULLET && unpark_bullet(file->dll, &parked)) {
+		// The globals are reinitialized in place
+		entity->globals = parked.globals;
+		cold->globals_slab = parked.globals_slab;
+
+		entity->body_id = parked.body_id;
+		cold->shape_id = parked.shape_id;
+
+		cold->i32_map = parked.i32_map;
+		clear_i32_map(&cold->i32_map);
+
+		cold->bullet.has_parked_body = true;
+		cold->bullet.parked_texture = parked.texture;
+		cold->bullet.parked_density = parked.density;
+		cold->bullet.parked_width = parked.width;
+		cold->bullet.parked_height = parked.height;
+	} else {
+		cold->globals_slab = get_globals_slab(file);
+		entity->globals = allocate_globals(cold->globals_slab);
+	}
+	file->init_globals_fn(entity->globals, entity->id);
+
+	entity->on_fns = file->on_fns;
+
+	entity->type = type;
+
+	entity->texture = UINT32_MAX;
+
+	cold->tick_group = UINT32_MAX;
+	cold->texture_index = UINT32_MAX;
+
+	add_to_dll_entities(entity);
+
+	return entity;
+}
+
+static struct entity *create_entity(enum entity_type type, struct grug_file *file) {
+	u32 slot_index = allocate_entity_slot();
+	if (slot_index == UINT32_MAX) {
+		snprintf(message, sizeof(message), "Won't spawn entity, as there are no entity slots left\n");
+		add_message();
+
+		return NULL;
+	}
+
+	return create_entity_in_slot(slot_index, type, file);
+}
+
+// Returns the ID that the entity will get once the parallel tick's buffers are merged,
+// or UINT64_MAX if this range already spawned RESERVED_SLOTS_PER_TICK_RANGE entities
+static u64 push_tick_spawn(enum entity_type type, struct grug_file *file, struct spawn_command command) {
+	if (tick_buffer->used_reserved_slots >= tick_buffer->reserved_slots_size) {
+		add_formatted_message("Won't spawn entity, as more than %d entities were spawned by a single range of a parallel tick\n", RESERVED_SLOTS_PER_TICK_RANGE);
+
+		return UINT64_MAX;
+	}
+
+	u32 slot_index = tick_buffer->reserved_slots[tick_buffer->used_reserved_slots++];
+
+	command.id = get_entity_id(slot_index);
+
+	push_tick_command(TICK_COMMAND_SPAWN)->spawn = (struct tick_spawn){
+		.slot_index = slot_index,
+		.type = type,
+		.file = file,
+		.command = command,
+	};
+
+	return command.id;
+}
+
+// Calls the entity's on_spawn(), and acquires the texture that it picked
+static struct entity *finish_spawning_entity(u64 id) {
+	size_t entity_index = find_entity_index(id);
+	if (entity_index == SIZE_MAX) {
+		return NULL;
+	}
+	struct entity *entity = &entities[entity_index];
+
+	if (call_on_spawn(entity, entity->on_fns)) {
+		return NULL;
+	}
+
+	// on_spawn() can spawn and despawn other entities, which can move this entity
+	entity_index = find_entity_index(id);
+	if (entity_index == SIZE_MAX) {
+		return NULL;
+	}
+	entity = &entities[entity_index];
+
+	write_on_spawn_data_to_entity(entity);
+
+	if (entity->type != OBJECT_COUNTER) {
+		entity->texture = acquire_texture(get_texture_path(entity));
+		add_to_texture_users(entity);
+	}
+
+	add_to_tick_group(entity);
+
+	return entity;
+}
+
+static struct entity *spawn_entity(enum entity_type type, struct grug_file *file) {
+	struct entity *entity = create_entity(type, file);
+	if (!entity) {
+		return NULL;
+	}
+
+	return finish_spawning_entity(entity->id);
+}
+
+static void push_spawn_command(struct spawn_command command) {
+	if (spawn_commands_size >= spawn_commands_capacity) {
+		spawn_commands_capacity = spawn_commands_capacity == 0 ? INITIAL_SPAWN_COMMANDS_CAPACITY : spawn_commands_capacity * 2;
+		spawn_commands = counted_realloc(MEMORY_COMMANDS, spawn_commands, spawn_commands_capacity * sizeof(*spawn_commands));
+		if (!spawn_commands) {
+			fprintf(stderr, "Failed to grow spawn_commands[] to %zu commands\n", spawn_commands_capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	spawn_commands[spawn_commands_size++] = command;
+}
+
+u64 game_fn_spawn_counter(char *name) {
+	struct grug_file *file = get_entity_file(name);
+	if (!file) {
+		return UINT64_MAX;
+	}
+
+	if (tick_buffer) {
+		return push_tick_spawn(OBJECT_COUNTER, file, (struct spawn_command){0});
+	}
+
+	struct entity *entity = create_entity(OBJECT_COUNTER, file);
+	if (!entity) {
+		return UINT64_MAX;
+	}
+
+	push_spawn_command((struct spawn_command){ .id = entity->id });
+
+	return entity->id;
+}
+
+static b2ShapeId add_shape(b2BodyId body_id, Texture texture, bool enable_hit_events, float density) {
+	b2ShapeDef shape_def = b2DefaultShapeDef();
+
+	shape_def.enableHitEvents = enable_hit_events;
+	shape_def.density = density;
+
+	b2Polygon polygon = b2MakeBox(texture.width / 2.0f, texture.height / 2.0f);
+
+	return b2CreatePolygonShape(body_id, &shape_def, &polygon);
+}
+
+// Makes the entity get drawn at its body's current transform, without interpolating
+static void snap_entity_transform(struct entity *entity) {
+	entity->transform = b2Body_GetTransform(entity->body_id);
+	entity->previous_transform = entity->transform;
+}
+
+static void add_body(struct entity *entity, b2BodyDef body_def, bool flippable, bool enable_hit_events) {
+	body_def.userData = (void *)entity->id;
+
+	entity->body_id = b2CreateBody(world_id, &body_def);
+
+	snap_entity_transform(entity);
+
+	entity->flippable = flippable;
+
+	struct entity_cold *cold = get_cold(entity);
+
+	cold->enable_hit_events = enable_hit_events;
+
+	cold->shape_id = add_shape(entity->body_id, get_entity_texture(entity), enable_hit_events, entity->type == OBJECT_BULLET ? cold->bullet.density : 1.0f);
+}
+
+void game_fn_spawn_bullet(char *name, float x, float y, float angle_in_degrees, float velocity_in_meters_per_second) {
+	struct grug_file *file = get_entity_file(name);
+	if (!file) {
+		return;
+	}
+
+	struct spawn_command command = {
+		.x = x,
+		.y = y,
+		.angle_in_degrees = angle_in_degrees,
+		.velocity_in_meters_per_second = velocity_in_meters_per_second,
+	};
+
+	if (tick_buffer) {
+		push_tick_spawn(OBJECT_BULLET, file, command);
+		return;
+	}
+
+	struct entity *entity = create_entity(OBJECT_BULLET, file);
+	if (!entity) {
+		return;
+	}
+
+	command.id = entity->id;
+	push_spawn_command(command);
+}
+
+// Reenables the parked body that create_entity() handed this bullet
+static void unpark_body(struct entity *entity, b2BodyDef body_def) {
+	struct entity_cold *cold = get_cold(entity);
+
+	cold->bullet.has_parked_body = false;
+
+	entity->flippable = false;
+	cold->enable_hit_events = true;
+
+	// The shape only needs to be rebuilt when on_spawn() picked a different sprite or density,
+	// or when the sprite got reloaded with a different size while the bullet was parked
+	Texture texture = get_entity_texture(entity);
+	bool resized = texture.width != cold->bullet.parked_width || texture.height != cold->bullet.parked_height;
+
+	if (entity->texture != cold->bullet.parked_texture || cold->bullet.density != cold->bullet.parked_density || resized) {
+		b2DestroyShape(cold->shape_id, true);
+		cold->shape_id = add_shape(entity->body_id, get_entity_texture(entity), cold->enable_hit_events, cold->bullet.density);
+	}
+
+	// Released after finish_spawning_entity() acquired the new texture,
+	// so reusing the same sprite doesn't unload and reload it
+	release_texture(cold->bullet.parked_texture);
+
+	b2Body_SetUserData(entity->body_id, (void *)entity->id);
+	b2Body_SetTransform(entity->body_id, body_def.position, body_def.rotation);
+	b2Body_SetLinearVelocity(entity->body_id, body_def.linearVelocity);
+	b2Body_SetAngularVelocity(entity->body_id, 0.0f);
+	b2Body_Enable(entity->body_id);
+
+	snap_entity_transform(entity);
+}
+
+// Calls every on_spawn() first, and only then creates all of the bodies in one go
+static void apply_spawn_commands(void) {
+	// on_spawn() can push more commands, so spawn_commands_size is reread every iteration
+	for (size_t i = 0; i < spawn_commands_size; i++) {
+		finish_spawning_entity(spawn_commands[i].id);
+	}
+
+	for (size_t i = 0; i < spawn_commands_size; i++) {
+		struct spawn_command command = spawn_commands[i];
+
+		size_t entity_index = find_entity_index(command.id);
+		if (entity_index == SIZE_MAX) {
+			continue;
+		}
+		struct entity *entity = &entities[entity_index];
+
+		// Counters don't have a body
+		if (entity->type != OBJECT_BULLET) {
+			continue;
+		}
+
+		struct entity_cold *cold = get_cold(entity);
+
+		// A failed on_spawn() leaves the entity without a texture, and so without a body
+		if (entity->texture == UINT32_MAX) {
+			if (cold->bullet.has_parked_body) {
+				b2DestroyBody(entity->body_id);
+				release_texture(cold->bullet.parked_texture);
+				cold->bullet.has_parked_body = false;
+			}
+			continue;
+		}
+
+		b2Vec2 muzzle_pos = get_bullet_muzzle_pos(entity, command.x, command.y);
+
+		b2BodyDef body_def = get_bullet_body_def(muzzle_pos, command.angle_in_degrees, command.velocity_in_meters_per_second);
+
+		if (cold->bullet.has_parked_body) {
+			unpark_body(entity, body_def);
+		} else {
+			add_body(entity, body_def, false, true);
+		}
+	}
+
+	spawn_commands_size = 0;
+}
+
+// The sync point where the spawns and despawns that on_fns requested are applied
+// It is only called when no on_fn is running, and nothing is iterating entities[]
+static void apply_commands(void) {
+	// Applying the commands calls on_spawn() and on_despawn(), which can push new commands
+	while (spawn_commands_size > 0 || despawn_queue_size > 0) {
+		apply_spawn_commands();
+		drain_despawn_queue();
+	}
+}
+
+void game_fn_set_counter_name(char *name) {
+	counter_on_spawn_data.name = name;
+}
+
+void game_fn_set_box_sprite_path(char *sprite_path) {
+	box_on_spawn_data.sprite_path = sprite_path;
+}
+void game_fn_set_box_name(char *name) {
+	box_on_spawn_data.name = name;
+}
+
+void game_fn_set_bullet_density(float density) {
+	bullet_on_spawn_data.density = density;
+}
+void game_fn_set_bullet_sprite_path(char *sprite_path) {
+	bullet_on_spawn_data.sprite_path = sprite_path;
+}
+void game_fn_set_bullet_name(char *name) {
+	bullet_on_spawn_data.name = name;
+}
+
+void game_fn_set_gun_companion(char *companion) {
+	gun_on_spawn_data.companion = companion;
+}
+void game_fn_set_gun_rounds_per_minute(i32 rounds_per_minute) {
+	double rounds_per_second = rounds_per_minute / 60.0;
+	double seconds_per_round = 1.0 / rounds_per_second;
+
+	gun_on_spawn_data.ms_per_round_fired = seconds_per_round * 1000.0;
+}
+void game_fn_set_gun_sprite_path(char *sprite_path) {
+	gun_on_spawn_data.sprite_path = sprite_path;
+}
+void game_fn_set_gun_name(char *name) {
+	gun_on_spawn_data.name = name;
+}
+
+// Pops from the back of the worker's own queue
+static bool pop_chunk(size_t worker_index, struct task_chunk *chunk) {
+	struct worker *worker = &workers[worker_index];
+
+	pthread_mutex_lock(&worker->mutex);
+
+	bool popped = worker->chunks_size > 0;
+	if (popped) {
+		worker->chunks_size--;
+		*chunk = worker->chunks[(worker->chunks_start + worker->chunks_size) % MAX_WORKER_CHUNKS];
+	}
+
+	pthread_mutex_unlock(&worker->mutex);
+
+	return popped;
+}
+
+// Steals from the front of another worker's queue
+static bool steal_chunk(size_t thief_index, struct task_chunk *chunk) {
+	for (size_t i = 1; i < worker_count; i++) {
+		struct worker *victim = &workers[(thief_index + i) % worker_count];
+
+		pthread_mutex_lock(&victim->mutex);
+
+		bool stolen = victim->chunks_size > 0;
+		if (stolen) {
+			*chunk = victim->chunks[victim->chunks_start];
+			victim->chunks_start = (victim->chunks_start + 1) % MAX_WORKER_CHUNKS;
+			victim->chunks_size--;
+		}
+
+		pthread_mutex_unlock(&victim->mutex);
+
+		if (stolen) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool get_chunk(size_t worker_index, struct task_chunk *chunk) {
+	if (pop_chunk(worker_index, chunk) || steal_chunk(worker_index, chunk)) {
+		atomic_fetch_sub(&queued_chunks, 1);
+		return true;
+	}
+	return false;
+}
+
+static void run_chunk(size_t worker_index, struct task_chunk chunk) {
+	long long start_ns = get_monotonic_ns();
+
+	chunk.task->callback(chunk.start, chunk.end, worker_index, chunk.task->context);
+
+	atomic_fetch_add(chunk.task->is_tick ? &workers[worker_index].tick_busy_ns : &workers[worker_index].busy_ns, get_monotonic_ns() - start_ns);
+
+	atomic_fetch_sub(&chunk.task->unfinished_chunks, 1);
+}
+
+static bool push_chunk(size_t worker_index, struct task_chunk chunk) {
+	struct worker *worker = &workers[worker_index];
+
+	pthread_mutex_lock(&worker->mutex);
+
+	bool pushed = worker->chunks_size < MAX_WORKER_CHUNKS;
+	if (pushed) {
+		worker->chunks[(worker->chunks_start + worker->chunks_size) % MAX_WORKER_CHUNKS] = chunk;
+		worker->chunks_size++;
+	}
+
+	pthread_mutex_unlock(&worker->mutex);
+
+	return pushed;
+}
+
+static void *enqueue_task(b2TaskCallback *callback, int item_count, int min_range, void *task_context, void *user_context) {
+	// Returning NULL tells Box2D that the task was already run, so finish_task() won't be called for it
+	if (worker_count <= 1 || tasks_size >= MAX_TASKS) {
+		callback(0, item_count, 0, task_context);
+		return NULL;
+	}
+
+	int chunk_count = (item_count + min_range - 1) / min_range;
+	if (chunk_count > (int)worker_count) {
+		chunk_count = worker_count;
+	}
+	if (chunk_count < 1) {
+		chunk_count = 1;
+	}
+
+	int items_per_chunk = (item_count + chunk_count - 1) / chunk_count;
+
+	struct task *task = &tasks[tasks_size++];
+	task->callback = callback;
+	task->context = task_context;
+	task->is_tick = user_context == &parallel_tick_task_marker;
+	atomic_store(&task->unfinished_chunks, chunk_count);
+
+	int pushed_chunks = 0;
+
+	for (int i = 0; i < chunk_count; i++) {
+		struct task_chunk chunk = {
+			.task = task,
+			.start = i * items_per_chunk,
+			.end = (i + 1) * items_per_chunk < item_count ? (i + 1) * items_per_chunk : item_count,
+		};
+
+		if (chunk.start >= chunk.end) {
+			atomic_fetch_sub(&task->unfinished_chunks, 1);
+			continue;
+		}
+
+		// Spreading consecutive chunks over the workers is what lets Box2D's solver tasks,
+		// which wait on each other, all run at the same time
+		size_t worker_index = next_chunk_worker;
+		next_chunk_worker = (next_chunk_worker + 1) % worker_count;
+
+		if (push_chunk(worker_index, chunk)) {
+			pushed_chunks++;
+		} else {
+			run_chunk(0, chunk);
+		}
+	}
+
+	atomic_fetch_add(&queued_chunks, pushed_chunks);
+
+	pthread_mutex_lock(&workers_sleep_mutex);
+	pthread_cond_broadcast(&workers_wake_condition);
+	pthread_mutex_unlock(&workers_sleep_mutex);
+
+	return task;
+}
+
+static void finish_task(void *user_task, void *user_context) {
+	(void)user_context;
+
+	struct task *task = user_task;
+
+	// Instead of idling, the main thread helps run chunks
+	while (atomic_load(&task->unfinished_chunks) > 0) {
+		struct task_chunk chunk;
+		if (get_chunk(0, &chunk)) {
+			run_chunk(0, chunk);
+		}
+	}
+}
+
+static void *run_worker(void *arg) {
+	size_t worker_index = (size_t)arg;
+
+	while (!atomic_load(&workers_should_stop)) {
+		struct task_chunk chunk;
+		if (get_chunk(worker_index, &chunk)) {
+			run_chunk(worker_index, chunk);
+			continue;
+		}
+
+		pthread_mutex_lock(&workers_sleep_mutex);
+		while (atomic_load(&queued_chunks) <= 0 && !atomic_load(&workers_should_stop)) {
+			pthread_cond_wait(&workers_wake_condition, &workers_sleep_mutex);
+		}
+		pthread_mutex_unlock(&workers_sleep_mutex);
+	}
+
+	return NULL;
+}
+
+// A count of 0 uses one worker per CPU core
+static void start_workers(size_t count) {
+	if (count == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cores > 0 ? cores : 1;
+	}
+	if (count > MAX_WORKERS) {
+		count = MAX_WORKERS;
+	}
+
+	worker_count = count;
+
+	for (size_t i = 0; i < worker_count; i++) {
+		pthread_mutex_init(&workers[i].mutex, NULL);
+	}
+
+	// Worker 0 is the main thread
+	for (size_t i = 1; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker, (void *)i)) {
+			fprintf(stderr, "pthread_create() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void stop_workers(void) {
+	atomic_store(&workers_should_stop, true);
+
+	pthread_mutex_lock(&workers_sleep_mutex);
+	pthread_cond_broadcast(&workers_wake_condition);
+	pthread_mutex_unlock(&workers_sleep_mutex);
+
+	for (size_t i = 1; i < worker_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+}
+
+// Returns how much of the time spent in b2World_Step() the worker was busy, between 0.0 and 1.0
+static double get_worker_utilization(size_t worker_index) {
+	if (world_step_ns == 0) {
+		return 0.0;
+	}
+	return atomic_load(&workers[worker_index].busy_ns) / (double)world_step_ns;
+}
+
+// Returns how much of the time spent in parallel ticks the worker was busy, between 0.0 and 1.0
+static double get_worker_tick_utilization(size_t worker_index) {
+	if (parallel_tick_ns == 0) {
+		return 0.0;
+	}
+	return atomic_load(&workers[worker_index].tick_busy_ns) / (double)parallel_tick_ns;
+}
+
+static void reset_worker_utilization(void) {
+	for (size_t i = 0; i < worker_count; i++) {
+		atomic_store(&workers[i].busy_ns, 0);
+		atomic_store(&workers[i].tick_busy_ns, 0);
+	}
+	world_step_ns = 0;
+	parallel_tick_ns = 0;
+}
+
+static b2WorldId create_world(void) {
+	b2SetAllocator(allocate_box2d, counted_free);
+
+	b2SetLengthUnitsPerMeter(PIXELS_PER_METER);
+
+	b2WorldDef world_def = b2DefaultWorldDef();
+	world_def.gravity.y = -9.8f * PIXELS_PER_METER;
+	// world_def.hitEventThreshold = 0.1f;
+
+	world_def.workerCount = worker_count;
+	world_def.enqueueTask = enqueue_task;
+	world_def.finishTask = finish_task;
+
+	return b2CreateWorld(&world_def);
+}
+
+#ifndef HEADLESS
+static double get_elapsed_ms(struct timespec start, struct timespec end) {
+	return 1.0e3 * (double)(end.tv_sec - start.tv_sec) + 1.0e-6 * (double)(end.tv_nsec - start.tv_nsec);
+}
+#endif
+
+static long long get_cpu_ns(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+	return time.tv_sec * NANOSECONDS_PER_SECOND + time.tv_nsec;
+}
+
+static size_t add_zone(char *name, long long wall_start_ns) {
+	if (profiled_frame->zones_size >= MAX_FRAME_ZONES) {
+		profiled_frame->dropped_zones++;
+		return SIZE_MAX;
+	}
+
+	size_t zone_index = profiled_frame->zones_size++;
+
+	profiled_frame->zones[zone_index] = (struct zone){
+		.name = name,
+		.depth = open_zones_size,
+		.wall_start_ns = wall_start_ns,
+	};
+
+	return zone_index;
+}
+
+static void begin_zone(char *name) {
+	if (!profiled_frame) {
+		return;
+	}
+
+	if (open_zones_size >= MAX_ZONE_DEPTH) {
+		fprintf(stderr, "Zones are nested more than %d deep, exceeding MAX_ZONE_DEPTH\n", MAX_ZONE_DEPTH);
+		exit(EXIT_FAILURE);
+	}
+
+	long long wall_ns = get_monotonic_ns();
+	long long cpu_ns = get_cpu_ns();
+
+	size_t zone_index = add_zone(name, wall_ns);
+
+	open_zones[open_zones_size++] = (struct open_zone){
+		.zone_index = zone_index,
+		.wall_start_ns = wall_ns,
+		.cpu_start_ns = cpu_ns,
+		.mark_wall_ns = wall_ns,
+		.mark_cpu_ns = cpu_ns,
+	};
+}
+
+static void end_zone(void) {
+	if (!profiled_frame) {
+		return;
+	}
+
+	assert(open_zones_size > 0);
+
+	long long wall_ns = get_monotonic_ns();
+	long long cpu_ns = get_cpu_ns();
+
+	struct open_zone open = open_zones[--open_zones_size];
+
+	if (open.zone_index != SIZE_MAX) {
+		struct zone *zone = &profiled_frame->zones[open.zone_index];
+		zone->wall_ns = wall_ns - open.wall_start_ns;
+		zone->cpu_ns = cpu_ns - open.cpu_start_ns;
+	}
+
+	// The parent's next record() starts where this zone ended
+	if (open_zones_size > 0) {
+		open_zones[open_zones_size - 1].mark_wall_ns = wall_ns;
+		open_zones[open_zones_size - 1].mark_cpu_ns = cpu_ns;
+	}
+}
+
+// Adds a child zone to the innermost open zone, spanning from its previous record() until now
+static void record(char *description) {
+	if (!profiled_frame || open_zones_size == 0) {
+		return;
+	}
+
+	long long wall_ns = get_monotonic_ns();
+	long long cpu_ns = get_cpu_ns();
+
+	struct open_zone *parent = &open_zones[open_zones_size - 1];
+
+	size_t zone_index = add_zone(description, parent->mark_wall_ns);
+	if (zone_index != SIZE_MAX) {
+		struct zone *zone = &profiled_frame->zones[zone_index];
+		zone->wall_ns = wall_ns - parent->mark_wall_ns;
+		zone->cpu_ns = cpu_ns - parent->mark_cpu_ns;
+	}
+
+	parent->mark_wall_ns = wall_ns;
+	parent->mark_cpu_ns = cpu_ns;
+}
+
+#ifndef HEADLESS
+
+static size_t get_zone_histogram_bucket(long long wall_ns) {
+	double us = wall_ns / 1.0e3;
+	if (us < 1.0) {
+		return 0;
+	}
+
+	size_t bucket = (size_t)(log2(us) * ZONE_HISTOGRAM_BUCKETS_PER_DOUBLING) + 1;
+	return bucket < ZONE_HISTOGRAM_BUCKETS ? bucket : ZONE_HISTOGRAM_BUCKETS - 1;
+}
+
+// Returns the largest time in milliseconds that the bucket can hold
+static double get_zone_histogram_bucket_ms(size_t bucket) {
+	return pow(2.0, (double)bucket / ZONE_HISTOGRAM_BUCKETS_PER_DOUBLING) / 1.0e3;
+}
+
+// Returns NULL if the zone has no histogram, and there's no room to add it
+static struct zone_histogram *get_zone_histogram(char *name, u32 depth, bool add) {
+	for (size_t i = 0; i < zone_histograms_size; i++) {
+		if (zone_histograms[i].name == name && zone_histograms[i].depth == depth) {
+			return &zone_histograms[i];
+		}
+	}
+
+	// Histograms are never removed, so a zone that didn't fit when it was added is also skipped when it's removed
+	if (!add || zone_histograms_size >= MAX_ZONE_STATS) {
+		return NULL;
+	}
+
+	zone_histograms[zone_histograms_size] = (struct zone_histogram){
+		.name = name,
+		.depth = depth,
+	};
+
+	return &zone_histograms[zone_histograms_size++];
+}
+
+// Zones are told apart by their name and depth,
+// and the zones with the same name in one frame are summed, like the world steps of several ticks
+// A delta of 1 adds the frame to the histograms, and a delta of -1 removes it again
+static void update_zone_histograms(struct profiled_frame *frame, int delta) {
+	struct zone summed[MAX_ZONE_STATS];
+	size_t summed_size = 0;
+
+	for (size_t zone_index = 0; zone_index < frame->zones_size; zone_index++) {
+		struct zone zone = frame->zones[zone_index];
+
+		size_t i = 0;
+		while (i < summed_size && (summed[i].name != zone.name || summed[i].depth != zone.depth)) {
+			i++;
+		}
+
+		if (i < summed_size) {
+			summed[i].wall_ns += zone.wall_ns;
+		} else if (summed_size < MAX_ZONE_STATS) {
+			summed[summed_size++] = zone;
+		}
+	}
+
+	for (size_t i = 0; i < summed_size; i++) {
+		struct zone_histogram *histogram = get_zone_histogram(summed[i].name, summed[i].depth, delta > 0);
+		if (!histogram) {
+			continue;
+		}
+
+		histogram->counts[get_zone_histogram_bucket(summed[i].wall_ns)] += delta;
+		histogram->frames += delta;
+	}
+}
+
+#endif
+
+// Starts profiling a frame, overwriting the oldest one once the history is full
+static void begin_frame(void) {
+	if (!debug_info) {
+		profiled_frame = NULL;
+		return;
+	}
+
+	if (profiled_frames_size < PROFILED_FRAMES) {
+		profiled_frame = &profiled_frames[(profiled_frames_start + profiled_frames_size++) % PROFILED_FRAMES];
+	} else {
+		profiled_frame = &profiled_frames[profiled_frames_start];
+		profiled_frames_start = (profiled_frames_start + 1) % PROFILED_FRAMES;
+
+#ifndef HEADLESS
+		update_zone_histograms(profiled_frame, -1);
+#endif
+	}
+
+	profiled_frame->zones_size = 0;
+	profiled_frame->dropped_zones = 0;
+
+	open_zones_size = 0;
+	begin_zone("frame");
+}
+
+// Returns the profiled frame, or NULL if the frame wasn't profiled
+static struct profiled_frame *end_frame(void) {
+	while (open_zones_size > 0) {
+		end_zone();
+	}
+
+	struct profiled_frame *frame = profiled_frame;
+	profiled_frame = NULL;
+
+#ifndef HEADLESS
+	if (frame) {
+		update_zone_histograms(frame, 1);
+	}
+#endif
+
+	return frame;
+}
+
+#ifndef HEADLESS
+
+static struct profiled_frame *get_profiled_frame(size_t i) {
+	return &profiled_frames[(profiled_frames_start + i) % PROFILED_FRAMES];
+}
+
+// Uses the nearest-rank method, and returns the upper end of the bucket that the rank falls in
+static double get_percentile(struct zone_histogram *histogram, double percentile) {
+	size_t rank = ceil(percentile / 100.0 * histogram->frames);
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	size_t seen = 0;
+	for (size_t bucket = 0; bucket < ZONE_HISTOGRAM_BUCKETS; bucket++) {
+		seen += histogram->counts[bucket];
+		if (seen >= rank) {
+			return get_zone_histogram_bucket_ms(bucket);
+		}
+	}
+
+	return get_zone_histogram_bucket_ms(ZONE_HISTOGRAM_BUCKETS - 1);
+}
+
+static void update_zone_stats(void) {
+	zone_stats_size = 0;
+
+	if (profiled_frames_size == 0) {
+		return;
+	}
+
+	// The newest frame decides which zones are listed, and in what order
+	struct profiled_frame *newest = get_profiled_frame(profiled_frames_size - 1);
+
+	for (size_t zone_index = 0; zone_index < newest->zones_size && zone_stats_size < MAX_ZONE_STATS; zone_index++) {
+		struct zone listed = newest->zones[zone_index];
+
+		bool already_listed = false;
+		for (size_t i = 0; i < zone_stats_size; i++) {
+			if (zone_stats[i].name == listed.name && zone_stats[i].depth == listed.depth) {
+				already_listed = true;
+				break;
+			}
+		}
+		if (already_listed) {
+			continue;
+		}
+
+		struct zone_histogram *histogram = get_zone_histogram(listed.name, listed.depth, false);
+		if (!histogram || histogram->frames == 0) {
+			continue;
+		}
+
+		zone_stats[zone_stats_size++] = (struct zone_stats){
+			.name = listed.name,
+			.depth = listed.depth,
+			.p50 = get_percentile(histogram, 50.0),
+			.p95 = get_percentile(histogram, 95.0),
+			.p99 = get_percentile(histogram, 99.0),
+			.max = get_percentile(histogram, 100.0),
+		};
+	}
+}
+
+static void dump_mod_costs(void) {
+	FILE *csv = fopen("mod_costs.csv", "w");
+	if (!csv) {
+		snprintf(message, sizeof(message), "Failed to open mod_costs.csv for writing\n");
+		add_message();
+		return;
+	}
+
+	fprintf(csv, "entity,file,safe_calls,safe_ms,safe_us_per_call,fast_calls,fast_ms,fast_us_per_call\n");
+
+	for (size_t i = 0; i < mod_costs_size; i++) {
+		struct mod_cost *cost = &mod_costs[i];
+
+		fprintf(csv, "%s,%s,%lld,%f,%f,%lld,%f,%f\n", cost->entity, cost->file_name, atomic_load(&cost->calls[1]), atomic_load(&cost->ns[1]) / 1.0e6, get_mod_cost_us_per_call(cost, 1), atomic_load(&cost->calls[0]), atomic_load(&cost->ns[0]) / 1.0e6, get_mod_cost_us_per_call(cost, 0));
+	}
+
+	fclose(csv);
+
+	snprintf(message, sizeof(message), "Wrote the costs of %zu mods to mod_costs.csv\n", mod_costs_size);
+	add_message();
+}
+
+// raylib's allocations aren't hooked, so this estimates what the loaded textures take up in VRAM
+static size_t get_texture_bytes(void) {
+	size_t bytes = 0;
+
+	for (size_t i = 0; i < textures_size; i++) {
+		if (textures[i].texture.id > 0) {
+			Texture texture = textures[i].texture;
+			bytes += GetPixelDataSize(texture.width, texture.height, texture.format);
+		}
+	}
+
+	return bytes;
+}
+
+static void dump_memory(void) {
+	FILE *csv = fopen("memory.csv", "w");
+	if (!csv) {
+		snprintf(message, sizeof(message), "Failed to open memory.csv for writing\n");
+		add_message();
+		return;
+	}
+
+	fprintf(csv, "subsystem,current_bytes,peak_bytes,allocations\n");
+
+	for (size_t i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++) {
+		struct memory_usage *usage = &memory_usages[i];
+		fprintf(csv, "%s,%lld,%lld,%lld\n", memory_subsystem_names[i], atomic_load(&usage->current_bytes), atomic_load(&usage->peak_bytes), atomic_load(&usage->allocations));
+	}
+
+	// These are fixed size arrays, so they never allocate
+	fprintf(csv, "message ring,%zu,%zu,0\n", sizeof(messages), sizeof(messages));
+	fprintf(csv, "message buffer,%zu,%zu,0\n", sizeof(message), sizeof(message));
+	fprintf(csv, "tick buffers,%zu,%zu,0\n", sizeof(tick_buffers), sizeof(tick_buffers));
+	fprintf(csv, "profiled frames,%zu,%zu,0\n", sizeof(profiled_frames), sizeof(profiled_frames));
+	fprintf(csv, "zone histograms,%zu,%zu,0\n", sizeof(zone_histograms), sizeof(zone_histograms));
+
+	fprintf(csv, "textures (estimated VRAM),%zu,,\n", get_texture_bytes());
+
+	fclose(csv);
+
+	snprintf(message, sizeof(message), "Wrote the memory usage to memory.csv\n");
+	add_message();
+}
+
+// Writes the whole history as a Chrome trace, which chrome://tracing and Perfetto can open, and as CSV
+static void dump_profile(void) {
+	FILE *trace = fopen("profile.json", "w");
+	FILE *csv = fopen("profile.csv", "w");
+
+	if (!trace || !csv) {
+		snprintf(message, sizeof(message), "Failed to open profile.json or profile.csv for writing\n");
+		add_message();
+
+		if (trace) {
+			fclose(trace);
+		}
+		if (csv) {
+			fclose(csv);
+		}
+		return;
+	}
+
+	fprintf(trace, "{\"traceEvents\": [\n");
+	fprintf(csv, "frame,depth,name,wall_start_ms,wall_ms,cpu_ms\n");
+
+	long long first_ns = profiled_frames_size > 0 ? get_profiled_frame(0)->zones[0].wall_start_ns : 0;
+	bool first_event = true;
+
+	for (size_t frame_index = 0; frame_index < profiled_frames_size; frame_index++) {
+		struct profiled_frame *frame = get_profiled_frame(frame_index);
+
+		for (size_t i = 0; i < frame->zones_size; i++) {
+			struct zone zone = frame->zones[i];
+
+			fprintf(trace, "%s\t{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %zu, \"cpu_ms\": %f}}", first_event ? "" : ",\n", zone.name, (zone.wall_start_ns - first_ns) / 1.0e3, zone.wall_ns / 1.0e3, frame_index, zone.cpu_ns / 1.0e6);
+			first_event = false;
+
+			fprintf(csv, "%zu,%u,%s,%f,%f,%f\n", frame_index, zone.depth, zone.name, (zone.wall_start_ns - first_ns) / 1.0e6, zone.wall_ns / 1.0e6, zone.cpu_ns / 1.0e6);
+		}
+	}
+
+	fprintf(trace, "\n]}\n");
+
+	fclose(trace);
+	fclose(csv);
+
+	snprintf(message, sizeof(message), "Wrote the last %zu frames to profile.json and profile.csv\n", profiled_frames_size);
+	add_message();
+}
+
+#endif
+
+#ifndef HEADLESS
+
+static Vector2 world_to_screen(b2Vec2 p) {
+	return (Vector2){
+		  p.x * TEXTURE_SCALE + SCREEN_WIDTH  / 2.0f,
+		- p.y * TEXTURE_SCALE + SCREEN_HEIGHT / 2.0f
+	};
+}
+
+static void draw_debug_line(const char *text, int x) {
+	DrawText(text, x, debug_line_number++ * FONT_SIZE, FONT_SIZE, RAYWHITE);
+}
+
+static void draw_debug_line_left(const char *text) {
+	draw_debug_line(text, 0);
+}
+
+static void draw_debug_line_right(const char *text) {
+	draw_debug_line(text, SCREEN_WIDTH - MeasureText(text, FONT_SIZE));
+}
+
+static void draw_debug_info(void) {
+	debug_line_number = 0;
+
+	draw_debug_line_left(TextFormat("entities: %zu/%zu", entities_size, max_entities));
+
+	draw_debug_line_left(TextFormat("drawn entities: %zu", drawn_entities));
+
+	draw_debug_line_left(TextFormat("loaded textures: %zu", loaded_textures));
+
+	draw_debug_line_left(TextFormat("active voices: %zu/%zu", get_active_voice_count(), sounds_size * VOICES_PER_SOUND));
+
+	draw_debug_line_left(TextFormat("grug mode: %s", grug_are_on_fns_in_safe_mode() ? "safe" : "fast"));
+
+	draw_debug_line_left(TextFormat("mods: %s", mods_failed_to_regenerate ? "error, running the last code that compiled" : "up to date"));
+
+	draw_debug_line_left(TextFormat("tick mode: %s", !parallel_ticks ? "serial" : grug_are_on_fns_in_safe_mode() ? "serial (parallel needs fast grug mode)" : "parallel"));
+
+	for (size_t i = 0; i < worker_count; i++) {
+		draw_debug_line_left(TextFormat("worker %zu: %.0f%% busy during world step, %.0f%% during parallel ticks", i, get_worker_utilization(i) * 100.0, get_worker_tick_utilization(i) * 100.0));
+	}
+	reset_worker_utilization();
+
+	draw_debug_line_left("most expensive mods: total, per call in safe mode, per call in fast mode");
+
+	// Selection sort, since only the first SHOWN_MOD_COSTS are needed
+	bool shown[MAX_MOD_COSTS] = {0};
+	for (size_t rank = 0; rank < SHOWN_MOD_COSTS && rank < mod_costs_size; rank++) {
+		size_t most_expensive = SIZE_MAX;
+		long long most_expensive_ns = -1;
+
+		for (size_t i = 0; i < mod_costs_size; i++) {
+			long long ns = get_mod_cost_total_ns(&mod_costs[i]);
+			if (!shown[i] && ns > most_expensive_ns) {
+				most_expensive = i;
+				most_expensive_ns = ns;
+			}
+		}
+
+		shown[most_expensive] = true;
+
+		struct mod_cost *cost = &mod_costs[most_expensive];
+		draw_debug_line_left(TextFormat("  %s (%s): %.1f ms, %.2f us, %.2f us", cost->entity, cost->file_name, most_expensive_ns / 1.0e6, get_mod_cost_us_per_call(cost, 1), get_mod_cost_us_per_call(cost, 0)));
+	}
+
+	draw_debug_line_left("memory: current, peak, allocations since the last frame");
+
+	for (size_t i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++) {
+		struct memory_usage *usage = &memory_usages[i];
+
+		long long allocations = atomic_load(&usage->allocations);
+		draw_debug_line_left(TextFormat("  %s: %lld KB, %lld KB, %lld", memory_subsystem_names[i], atomic_load(&usage->current_bytes) / 1024, atomic_load(&usage->peak_bytes) / 1024, allocations - allocations_at_last_draw[i]));
+		allocations_at_last_draw[i] = allocations;
+	}
+
+	draw_debug_line_left(TextFormat("  textures (estimated VRAM): %zu KB", get_texture_bytes() / 1024));
+
+	debug_line_number = 0;
+
+	if (frames_since_zone_stats++ % PROFILER_STATS_INTERVAL == 0) {
+		update_zone_stats();
+	}
+
+	draw_debug_line_right(TextFormat("ms over the last %zu frames: p50 p95 p99 max", profiled_frames_size));
+
+	for (size_t i = 0; i < zone_stats_size; i++) {
+		struct zone_stats stats = zone_stats[i];
+		draw_debug_line_right(TextFormat("%*s%s: %.2f %.2f %.2f %.2f", (int)stats.depth * 2, "", stats.name, stats.p50, stats.p95, stats.p99, stats.max));
+	}
+}
+
+static void batch_entity(struct entity *entity) {
+	Texture texture = get_entity_texture(entity);
+
+	b2Transform transform = {
+		.p = b2Lerp(entity->previous_transform.p, entity->transform.p, interpolation_alpha),
+		.q = b2NLerp(entity->previous_transform.q, entity->transform.q, interpolation_alpha),
+	};
+
+	float half_width = texture.width / 2.0f;
+	float half_height = texture.height / 2.0f;
+
+	float angle = b2Rot_GetAngle(transform.q);
+	bool facing_left = (angle > PI / 2) || (angle < -PI / 2);
+
+	struct sprite_batch *batch = &sprite_batches[entity->texture];
+
+	if (batch->size == 0) {
+		used_sprite_batches[used_sprite_batches_size++] = entity->texture;
+	}
+
+	if (batch->size >= batch->capacity) {
+		batch->capacity = batch->capacity == 0 ? INITIAL_ENTITIES_CAPACITY : batch->capacity * 2;
+		batch->quads = counted_realloc(MEMORY_SPRITE_BATCHES, batch->quads, batch->capacity * sizeof(*batch->quads));
+		if (!batch->quads) {
+			fprintf(stderr, "Failed to grow a sprite batch to %zu quads\n", batch->capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct sprite_quad *quad = &batch->quads[batch->size++];
+
+	quad->corners[0] = world_to_screen(b2TransformPoint(transform, (b2Vec2){ -half_width, half_height }));
+	quad->corners[1] = world_to_screen(b2TransformPoint(transform, (b2Vec2){ -half_width, -half_height }));
+	quad->corners[2] = world_to_screen(b2TransformPoint(transform, (b2Vec2){ half_width, -half_height }));
+	quad->corners[3] = world_to_screen(b2TransformPoint(transform, (b2Vec2){ half_width, half_height }));
+
+	quad->flipped = entity->flippable && facing_left;
+
+	drawn_entities++;
+}
+
+// The part of the world that the screen shows, grown by CULLING_MARGIN
+static b2AABB get_camera_aabb(void) {
+	float half_width = SCREEN_WIDTH / 2.0f / TEXTURE_SCALE + CULLING_MARGIN;
+	float half_height = SCREEN_HEIGHT / 2.0f / TEXTURE_SCALE + CULLING_MARGIN;
+
+	return (b2AABB){
+		.lowerBound = { -half_width, -half_height },
+		.upperBound = { half_width, half_height },
+	};
+}
+
+// Called by b2World_OverlapAABB() for every shape whose fat AABB overlaps the camera
+static bool batch_visible_shape(b2ShapeId shape_id, void *context) {
+	b2AABB *camera_aabb = context;
+
+	// The broadphase stores fattened AABBs, so this rejects the shapes that only overlap because of that
+	if (!b2AABB_Overlaps(b2Shape_GetAABB(shape_id), *camera_aabb)) {
+		return true;
+	}
+
+	u64 id = (u64)b2Body_GetUserData(b2Shape_GetBody(shape_id));
+
+	size_t entity_index = find_entity_index(id);
+	if (entity_index == SIZE_MAX) {
+		return true;
+	}
+
+	struct entity *entity = &entities[entity_index];
+
+	if (entity->texture != UINT32_MAX) {
+		batch_entity(entity);
+	}
+
+	return true;
+}
+
+// Mirrors what DrawTexturePro() does for a single quad,
+// except that all quads of a texture share one rlBegin() and rlEnd()
+static void draw_sprite_batches(void) {
+	for (size_t i = 0; i < used_sprite_batches_size; i++) {
+		u32 texture_index = used_sprite_batches[i];
+		struct sprite_batch *batch = &sprite_batches[texture_index];
+
+		// Hidden until the texture has been decoded and uploaded
+		if (textures[texture_index].texture.id == 0) {
+			continue;
+		}
+
+		rlSetTexture(textures[texture_index].texture.id);
+		rlBegin(RL_QUADS);
+
+		rlColor4ub(WHITE.r, WHITE.g, WHITE.b, WHITE.a);
+		rlNormal3f(0.0f, 0.0f, 1.0f);
+
+		for (size_t quad_index = 0; quad_index < batch->size; quad_index++) {
+			struct sprite_quad quad = batch->quads[quad_index];
+
+			float top_v = quad.flipped ? 1.0f : 0.0f;
+			float bottom_v = quad.flipped ? 0.0f : 1.0f;
+
+			rlTexCoord2f(0.0f, top_v);
+			rlVertex2f(quad.corners[0].x, quad.corners[0].y);
+
+			rlTexCoord2f(0.0f, bottom_v);
+			rlVertex2f(quad.corners[1].x, quad.corners[1].y);
+
+			rlTexCoord2f(1.0f, bottom_v);
+			rlVertex2f(quad.corners[2].x, quad.corners[2].y);
+
+			rlTexCoord2f(1.0f, top_v);
+			rlVertex2f(quad.corners[3].x, quad.corners[3].y);
+		}
+
+		rlEnd();
+		rlSetTexture(0);
+	}
+
+	if (draw_bounding_box) {
+		Color color = {.r=42, .g=42, .b=242, .a=100};
+
+		for (size_t i = 0; i < used_sprite_batches_size; i++) {
+			struct sprite_batch *batch = &sprite_batches[used_sprite_batches[i]];
+
+			for (size_t quad_index = 0; quad_index < batch->size; quad_index++) {
+				Vector2 *corners = batch->quads[quad_index].corners;
+				DrawTriangle(corners[0], corners[1], corners[2], color);
+				DrawTriangle(corners[0], corners[2], corners[3], color);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < used_sprite_batches_size; i++) {
+		sprite_batches[used_sprite_batches[i]].size = 0;
+	}
+	used_sprite_batches_size = 0;
+}
+
+static void draw(void) {
+	begin_zone("draw");
+
+	BeginDrawing();
+	record("beginning drawing");
+
+	DrawTextureEx(background_texture, Vector2Zero(), 0, 2, WHITE);
+	record("drawing background");
+
+	// Only the entities whose shapes overlap the camera get visited,
+	// so off-screen entities cost nothing here
+	drawn_entities = 0;
+	b2AABB camera_aabb = get_camera_aabb();
+	b2World_OverlapAABB(world_id, camera_aabb, b2DefaultQueryFilter(), batch_visible_shape, &camera_aabb);
+	record("batching entities");
+
+	draw_sprite_batches();
+	record("drawing entities");
+
+	// Color red = {.r=242, .g=42, .b=42, .a=255};
+	// DrawLine(gun_screen_pos.x, gun_screen_pos.y, mouse_pos.x, mouse_pos.y, red);
+	// record("drawing gun line");
+
+	struct timespec current_time;
+	clock_gettime(CLOCK_MONOTONIC, &current_time);
+
+	size_t i = 0;
+	size_t start = messages_start;
+	size_t size = messages_size;
+	while (i < size) {
+		double elapsed_ms = get_elapsed_ms(messages[(start + i) % MAX_MESSAGES].time, current_time);
+		if (elapsed_ms < ERROR_MESSAGE_DURATION_MS) {
+			break;
+		}
+
+		// Remove the old error message
+		messages_start = (messages_start + 1) % MAX_MESSAGES;
+		messages_size--;
+
+		i++;
+	}
+	record("clearing old error messages");
+
+	for (i = 0; i < messages_size; i++) {
+		Color color = RAYWHITE;
+
+		double elapsed_ms = get_elapsed_ms(messages[(messages_start + i) % MAX_MESSAGES].time, current_time);
+		if (elapsed_ms > ERROR_MESSAGE_FADING_MOMENT_MS) {
+			double alpha = 255.0 * (ERROR_MESSAGE_DURATION_MS - elapsed_ms) / (double)(ERROR_MESSAGE_DURATION_MS - ERROR_MESSAGE_FADING_MOMENT_MS);
+			if (alpha < 0.0) {
+				alpha = 0.0;
+			}
+			assert(alpha >= 0.0 && alpha <= 255.0);
+			color.a = alpha;
+		}
+
+		DrawText(messages[(messages_start + i) % MAX_MESSAGES].message, 0, SCREEN_HEIGHT - FONT_SIZE * (messages_size - i), FONT_SIZE, color);
+	}
+	record("drawing error message");
+
+	record("end");
+
+	if (debug_info) {
+		draw_debug_info();
+	}
+
+	// This includes waiting on the swap, which CPU time doesn't show
+	EndDrawing();
+	record("ending drawing");
+
+	end_zone();
+}
+
+#endif
+
+static void play_collision_sound(b2ContactHitEvent *event) {
+	// printf("approachSpeed: %f\n", event->approachSpeed);
+
+	float x_normalized = (event->point.x * TEXTURE_SCALE) / (SCREEN_WIDTH / 2); // Between -1.0f and 1.0f
+	// printf("x_normalized: %f\n", x_normalized);
+
+	float y_normalized = (event->point.y * TEXTURE_SCALE) / (SCREEN_HEIGHT / 2); // Between -1.0f and 1.0f
+	// printf("y_normalized: %f\n", y_normalized);
+
+	float distance = sqrtf(x_normalized * x_normalized + y_normalized * y_normalized);
+	// printf("distance: %f\n", distance);
+
+	float audibility = 1.0f;
+	if (distance > 0.0f) { // Prevents a later division by 0.0f
+		distance *= 5.0f;
+
+		// This considers the game to be a 3D space
+		// See https://en.wikipedia.org/wiki/Inverse-square_law
+		audibility = 1.0f / (distance * distance); // Between 0.0f and 1.0f
+
+		// This considers the game to be a 2D space
+		// audibility = 1.0f / distance; // Between 0.0f and 1.0f
+
+		assert(audibility >= 0.0f);
+	}
+	// printf("audibility: %f\n", audibility);
+
+	float volume = event->approachSpeed * 0.01f;
+
+	volume *= audibility;
+
+	if (volume > 1.0f) {
+		volume = 1.0f;
+	}
+	if (volume < 0.01f) {
+		return;
+	}
+
+	u32 sound = rand() % 2 == 0 ? metal_blunt_1 : metal_blunt_2;
+
+	float speed = event->approachSpeed * 0.005f;
+	// printf("speed: %f\n", speed);
+	float min_pitch = 0.5f;
+	float max_pitch = 1.5f;
+	float pitch = min_pitch + speed;
+	// printf("pitch: %f\n", pitch);
+	if (pitch > max_pitch) {
+		pitch = max_pitch;
+	}
+
+	float x_normalized_inverted = -x_normalized; // Because a pan of 1.0f means all the way left, instead of right
+	float pan = 0.5f + x_normalized_inverted / 2.0f; // Between 0.0f and 1.0f
+	// printf("pan: %f\n", pan);
+
+	play_voice(sound, volume, pitch, pan);
+}
+
+static void spawn_companion(char *name) {
+	struct grug_file *file = get_entity_file(name);
+	if (!file) {
+		return;
+	}
+
+	struct entity *entity = spawn_entity(OBJECT_BOX, file);
+	if (!entity) {
+		return;
+	}
+
+	b2BodyDef body_def = b2DefaultBodyDef();
+	body_def.type = b2_dynamicBody;
+	body_def.position = (b2Vec2){ 50.0f, 100.0f };
+
+	add_body(entity, body_def, false, true);
+}
+
+static void spawn_gun(struct grug_file *file, b2Vec2 pos) {
+	b2BodyDef body_def = b2DefaultBodyDef();
+	body_def.position = pos;
+
+	gun = spawn_entity(OBJECT_GUN, file);
+	assert(gun); // spawn_gun() is only ever called once, which is at startup
+
+	add_body(gun, body_def, true, false);
+
+	// grow_entities() keeps gun pointing at the gun when this grows entities[]
+	spawn_companion(gun_on_spawn_data.companion);
+}
+
+static void spawn_boxes(struct grug_file *file, int spawned_box_count) {
+	for (int i = 0; i < spawned_box_count; i++) {
+		struct entity *entity = spawn_entity(OBJECT_BOX, file);
+		if (!entity) {
+			break;
+		}
+
+		// Since the box may use a game fn to pick a random sprite_path,
+		// every individual box needs to look up its own texture
+		Texture texture = get_entity_texture(entity);
+
+		b2BodyDef body_def = b2DefaultBodyDef();
+		body_def.type = b2_dynamicBody;
+		body_def.position = (b2Vec2){ -100.0f, (i - spawned_box_count / 2) * texture.height + 1000.0f };
+
+		add_body(entity, body_def, false, true);
+	}
+}
+
+static void spawn_ground(struct grug_file *file) {
+	int ground_entity_count = 16;
+
+	for (int i = 0; i < ground_entity_count; i++) {
+		struct entity *entity = spawn_entity(OBJECT_BOX, file);
+		if (!entity) {
+			break;
+		}
+
+		// Since the box may use a game fn to pick a random sprite_path,
+		// every individual box needs to look up its own texture
+		Texture texture = get_entity_texture(entity);
+
+		b2BodyDef body_def = b2DefaultBodyDef();
+		body_def.position = (b2Vec2){ (i - ground_entity_count / 2) * texture.width, -100.0f };
+
+		add_body(entity, body_def, false, false);
+	}
+}
+
+static void reload_entity_shape(struct entity *entity) {
+	struct entity_cold *cold = get_cold(entity);
+
+	b2DestroyShape(cold->shape_id, true);
+	cold->shape_id = add_shape(entity->body_id, get_entity_texture(entity), cold->enable_hit_events, entity->type == OBJECT_BULLET ? cold->bullet.density : 1.0f);
 }
 
-static struct entity *spawn_entity(enum entity_type type, struct grug_file *file) {
-	if (entities_size >= MAX_ENTITIES) {
-		snprintf(message, sizeof(message), "Won't spawn entity, as there are already %d entities, exceeding MAX_ENTITIES\n", MAX_ENTITIES);
-		add_message();
+static void set_entity_texture(struct entity *entity, char *texture_path) {
+	fprintf(stderr, "Setting entity texture %s\n", texture_path);
 
-		return NULL;
+	// The new texture is acquired before the old one is released,
+	// so that keeping the same path doesn't unload and reload the texture
+	u32 old_texture = entity->texture;
+	u32 new_texture = acquire_texture(texture_path);
+
+	if (new_texture != old_texture) {
+		remove_from_texture_users(entity);
+		entity->texture = new_texture;
+		add_to_texture_users(entity);
 	}
 
-	size_t entity_index = entities_size++;
-	struct entity *entity = &entities[entity_index];
+	release_texture(old_texture);
 
-	*entity = (struct entity){0};
+	reload_entity_shape(entity);
+}
 
-	entity->id = next_entity_id;
-	if (entity->id == UINT64_MAX) {
-		next_entity_id = 0;
-	} else {
-		next_entity_id++;
+static void reload_entity(struct entity *entity, struct grug_file *file) {
+	u64 id = entity->id;
+
+	call_on_despawn(entity, entity->on_fns);
+
+	// on_despawn() and on_spawn() can spawn and despawn other entities, which can move this entity
+	size_t entity_index = find_entity_index(id);
+	if (entity_index == SIZE_MAX) {
+		return;
 	}
+	entity = &entities[entity_index];
 
-	entity->dll = file->dll;
+	// Its tick group holds the old globals and tick function
+	remove_from_tick_group(entity);
 
-	entity->globals = malloc(file->globals_size);
-	file->init_globals_fn(entity->globals, entity->id);
+	struct entity_cold *cold = get_cold(entity);
 
-	entity->on_fns = file->on_fns;
+	remove_from_dll_entities(entity);
+	cold->dll = file->dll;
+	add_to_dll_entities(entity);
 
-	entity->type = type;
+	cold->mod_cost = get_mod_cost_index(file);
 
-	entity->i32_map = malloc(sizeof(*entity->i32_map));
-	memset(entity->i32_map->buckets, 0xff, MAX_I32_MAP_ENTRIES * sizeof(u32));
-	entity->i32_map->size = 0;
+	free_globals(cold->globals_slab, entity->globals);
+	cold->globals_slab = get_globals_slab(file);
+	entity->globals = allocate_globals(cold->globals_slab);
+	file->init_globals_fn(entity->globals, entity->id);
+
+	entity->on_fns = file->on_fns;
 
 	if (call_on_spawn(entity, file->on_fns)) {
-		return NULL;
+		return;
+	}
+
+	entity_index = find_entity_index(id);
+	if (entity_index == SIZE_MAX) {
+		return;
 	}
+	entity = &entities[entity_index];
 
 	write_on_spawn_data_to_entity(entity);
 
-	return entity;
-}
+	add_to_tick_group(entity);
 
-u64 game_fn_spawn_counter(char *name) {
-	struct grug_file *file = grug_get_entity_file(name);
-	struct entity *entity = spawn_entity(OBJECT_COUNTER, file);
-	return entity ? entity->id : UINT64_MAX;
+	// Counters don't have a texture
+	if (entity->texture != UINT32_MAX) {
+		set_entity_texture(entity, get_texture_path(entity));
+	}
 }
 
-static b2ShapeId add_shape(b2BodyId body_id, Texture texture, bool enable_hit_events, float density) {
-	b2ShapeDef shape_def = b2DefaultShapeDef();
+static void reload_modified_resources(void) {
+	for (size_t i = 0; i < grug_resource_reloads_size; i++) {
+		struct grug_modified_resource reload = grug_resource_reloads[i];
 
-	shape_def.enableHitEvents = enable_hit_events;
-	shape_def.density = density;
+		fprintf(stderr, "Reloading resource %s\n", reload.path);
 
-	b2Polygon polygon = b2MakeBox(texture.width / 2.0f, texture.height / 2.0f);
+		char *path = find_interned(reload.path);
+		if (!path) {
+			continue;
+		}
 
-	return b2CreatePolygonShape(body_id, &shape_def, &polygon);
+		u32 texture_index = get_texture_index(path);
+		if (texture_index == UINT32_MAX || textures[texture_index].ref_count == 0) {
+			continue;
+		}
+
+		struct texture_entry *entry = &textures[texture_index];
+
+		// The old texture stays visible until the new one has been decoded and uploaded
+		entry->generation++;
+		queue_texture_decode(texture_index, entry->path, entry->generation);
+	}
 }
 
-static void add_body(struct entity *entity, b2BodyDef body_def, bool flippable, bool enable_hit_events) {
-	body_def.userData = (void *)(entities_size - 1);
+// Swaps in the textures that the decoder threads finished, until the frame's budget is used up
+static void upload_decoded_textures(void) {
+	begin_zone("upload_decoded_textures");
 
-	entity->body_id = b2CreateBody(world_id, &body_def);
+	long long start_ns = get_monotonic_ns();
 
-	entity->flippable = flippable;
+	pthread_mutex_lock(&decode_mutex);
 
-	entity->enable_hit_events = enable_hit_events;
+	// At least one texture is uploaded every frame, so a slow upload can't starve the rest
+	while (decoded_images_size > 0) {
+		struct decoded_image decoded = decoded_images[--decoded_images_size];
+		pthread_mutex_unlock(&decode_mutex);
 
-	char *texture_path = get_texture_path(entity);
+		struct texture_entry *entry = &textures[decoded.texture];
+
+		if (decoded.generation == entry->generation && !decoded.image.data) {
+			snprintf(message, sizeof(message), "Failed to decode the texture %s after %d attempts\n", entry->path, MAX_DECODE_ATTEMPTS);
+			add_message();
+		} else if (decoded.generation == entry->generation) {
+			Texture old_texture = entry->texture;
 
-	entity->texture = LoadTexture(texture_path);
-	assert(entity->texture.id > 0);
+			if (old_texture.id > 0) {
+				unload_texture(old_texture);
+			} else {
+				loaded_textures++;
+			}
 
-	entity->texture_path = strdup(texture_path);
+			entry->texture = upload_texture(decoded.image);
 
-	entity->shape_id = add_shape(entity->body_id, entity->texture, enable_hit_events, entity->type == OBJECT_BULLET ? entity->bullet.density : 1.0f);
-}
+			// Only the shapes of the entities using this texture need to be rebuilt,
+			// and only when the texture's size changed
+			if (entry->texture.width != old_texture.width || entry->texture.height != old_texture.height) {
+				struct entity_list *users = &entry->users;
+				for (size_t user_index = 0; user_index < users->size; user_index++) {
+					reload_entity_shape(&entities[find_entity_index(users->ids[user_index])]);
+				}
+			}
+		}
 
-void game_fn_spawn_bullet(char *name, float x, float y, float angle_in_degrees, float velocity_in_meters_per_second) {
-	struct grug_file *file = grug_get_entity_file(name);
+		UnloadImage(decoded.image);
 
-	struct entity *entity = spawn_entity(OBJECT_BULLET, file);
-	if (!entity) {
-		return;
-	}
+		pthread_mutex_lock(&decode_mutex);
 
-	b2Vec2 muzzle_pos = get_bullet_muzzle_pos(entity, x, y);
+		if ((get_monotonic_ns() - start_ns) / 1.0e6 > TEXTURE_UPLOAD_BUDGET_MS) {
+			break;
+		}
+	}
 
-	b2BodyDef body_def = get_bullet_body_def(muzzle_pos, angle_in_degrees, velocity_in_meters_per_second);
+	pthread_mutex_unlock(&decode_mutex);
 
-	add_body(entity, body_def, false, true);
+	end_zone();
 }
 
-void game_fn_set_counter_name(char *name) {
-	counter_on_spawn_data.name = name;
-}
+static void reload_modified_entities(void) {
+	for (size_t i = 0; i < grug_reloads_size; i++) {
+		struct grug_modified reload = grug_reloads[i];
 
-void game_fn_set_box_sprite_path(char *sprite_path) {
-	box_on_spawn_data.sprite_path = sprite_path;
-}
-void game_fn_set_box_name(char *name) {
-	box_on_spawn_data.name = name;
-}
+		fprintf(stderr, "Reloading %s\n", reload.path);
 
-void game_fn_set_bullet_density(float density) {
-	bullet_on_spawn_data.density = density;
-}
-void game_fn_set_bullet_sprite_path(char *sprite_path) {
-	bullet_on_spawn_data.sprite_path = sprite_path;
-}
-void game_fn_set_bullet_name(char *name) {
-	bullet_on_spawn_data.name = name;
-}
+		empty_bullet_pool(reload.old_dll);
 
-void game_fn_set_gun_companion(char *companion) {
-	gun_on_spawn_data.companion = companion;
-}
-void game_fn_set_gun_rounds_per_minute(i32 rounds_per_minute) {
-	double rounds_per_second = rounds_per_minute / 60.0;
-	double seconds_per_round = 1.0 / rounds_per_second;
+		detach_globals_slab(reload.old_dll);
 
-	gun_on_spawn_data.ms_per_round_fired = seconds_per_round * 1000.0;
-}
-void game_fn_set_gun_sprite_path(char *sprite_path) {
-	gun_on_spawn_data.sprite_path = sprite_path;
+		struct entity_list reloaded = take_dll_entities(reload.old_dll);
+
+		// The old tick group is removed before any entity gets reloaded,
+		// since the new .so could be loaded at the same address
+		for (size_t id_index = 0; id_index < reloaded.size; id_index++) {
+			remove_from_tick_group(&entities[find_entity_index(reloaded.ids[id_index])]);
+		}
+		remove_tick_group(reload.old_dll);
+
+		for (size_t id_index = 0; id_index < reloaded.size; id_index++) {
+			// An earlier entity's on_despawn() or on_spawn() can have despawned this one
+			size_t entity_index = find_entity_index(reloaded.ids[id_index]);
+			if (entity_index != SIZE_MAX) {
+				reload_entity(&entities[entity_index], &reload.file);
+			}
+		}
+
+		counted_free(reloaded.ids);
+	}
 }
-void game_fn_set_gun_name(char *name) {
-	gun_on_spawn_data.name = name;
+
+// Returns whether regenerating the mods failed
+// The files that grug managed to reload before hitting an error are still applied,
+// while the file with the error keeps running its old code
+// This relies on grug only adding a file to grug_reloads once its new .so replaced the old one,
+// which grug.h doesn't promise, so this has to be checked again whenever grug is updated
+// Not applying them isn't an option either, as their entities would keep calling into the closed .so
+// TODO: Compile on a background thread, so saving a big mod doesn't hitch the frame,
+// which needs grug to stop compiling into its globals and closing the .so files the frame is running
+static bool regenerate_modified_mods(void) {
+	bool failed = grug_regenerate_modified_mods();
+	if (failed) {
+		if (grug_loading_error_in_grug_file) {
+			snprintf(message, sizeof(message), "grug loading error: %s, in %s (detected by grug.c:%d)\n", grug_error.msg, grug_error.path, grug_error.grug_c_line_number);
+		} else {
+			snprintf(message, sizeof(message), "grug loading error: %s (detected by grug.c:%d)\n", grug_error.msg, grug_error.grug_c_line_number);
+		}
+		add_message();
+	}
+	mods_failed_to_regenerate = failed;
+	record("mod regeneration");
+
+	// Reloaded entities can spawn others by name, so the index has to be up to date first
+	index_grug_files();
+	record("indexing mods");
+
+	reload_modified_entities();
+	record("reloading entities");
+
+	reload_modified_resources();
+	record("reloading resources");
+
+	apply_commands();
+	record("applying commands");
+
+	return failed;
 }
 
-static double get_elapsed_ms(struct timespec start, struct timespec end) {
-	return 1.0e3 * (double)(end.tv_sec - start.tv_sec) + 1.0e-6 * (double)(end.tv_nsec - start.tv_nsec);
+static struct grug_file *get_box_file(char *entity) {
+	struct named_file *entry = find_named_file(entity);
+	if (!entry || entry->ambiguous || !streq(entry->file->entity_type, "box")) {
+		return NULL;
+	}
+
+	return entry->file;
 }
 
-static void draw_debug_line(const char *text, int x) {
-	DrawText(text, x, debug_line_number++ * FONT_SIZE, FONT_SIZE, RAYWHITE);
+static void spawn_initial_entities(struct grug_file *gun_file, struct grug_file *concrete_file, struct grug_file *crate_file, int crate_count) {
+	b2Vec2 pos = { 100.0f, 0 };
+
+	spawn_gun(gun_file, pos);
+
+	struct entity_cold *gun_cold = get_cold(gun);
+	free_globals(gun_cold->globals_slab, gun->globals);
+	gun_cold->globals_slab = get_globals_slab(gun_file);
+	gun->globals = allocate_globals(gun_cold->globals_slab);
+	gun_file->init_globals_fn(gun->globals, gun->id);
+
+	spawn_ground(concrete_file);
+	spawn_boxes(crate_file, crate_count);
+
+	apply_commands();
 }
 
-static void draw_debug_line_left(const char *text) {
-	draw_debug_line(text, 0);
+static void step_world(float delta_time) {
+	begin_zone("step_world");
+
+	tasks_size = 0;
+
+	long long start_ns = get_monotonic_ns();
+	b2World_Step(world_id, delta_time, SUBSTEP_COUNT);
+	world_step_ns += get_monotonic_ns() - start_ns;
+	record("world step");
+
+	for (size_t i = 0; i < entities_size; i++) {
+		struct entity *entity = &entities[i];
+
+		if (entity->texture != UINT32_MAX) {
+			entity->previous_transform = entity->transform;
+			entity->transform = b2Body_GetTransform(entity->body_id);
+		}
+	}
+	record("caching transforms");
+
+	// Only bodies that moved can have entered the kill zone,
+	// and every body is reported at most once per step, so the queue holds no duplicates
+	b2BodyEvents events = b2World_GetBodyEvents(world_id);
+	for (i32 i = 0; i < events.moveCount; i++) {
+		b2BodyMoveEvent *event = events.moveEvents + i;
+		if (event->transform.p.y < KILL_ZONE_Y) {
+			queue_despawn((u64)event->userData);
+		}
+	}
+	record("getting body events");
+
+	b2ContactEvents contactEvents = b2World_GetContactEvents(world_id);
+	for (i32 i = 0; i < contactEvents.hitCount; i++) {
+		b2ContactHitEvent *event = &contactEvents.hitEvents[i];
+		// printf("Hit event!\n");
+		play_collision_sound(event);
+	}
+	record("collision handling");
+
+	apply_commands();
+	record("removing entities");
+
+	trim_bullet_pools();
+	record("trimming bullet pools");
+
+	end_zone();
 }
 
-static void draw_debug_line_right(const char *text) {
-	draw_debug_line(text, SCREEN_WIDTH - MeasureText(text, FONT_SIZE));
+static void fire_gun(void) {
+	struct gun_on_fns *on_fns = gun->on_fns;
+	if (on_fns->fire) {
+		begin_zone("fire_gun");
+
+		long long start_ns = get_monotonic_ns();
+		on_fns->fire(gun->globals);
+		add_mod_cost(get_cold(gun)->mod_cost, 1, get_monotonic_ns() - start_ns);
+		record("calling the gun's on_fire()");
+
+		apply_commands();
+		record("applying commands");
+
+		end_zone();
+	}
 }
 
-static void draw_debug_info(void) {
-	debug_line_number = 0;
+static void release_reserved_entity_slot(u32 slot_index) {
+	entity_slots[slot_index].next_free = first_free_entity_slot;
+	first_free_entity_slot = slot_index;
+}
 
-	draw_debug_line_left(TextFormat("entities: %zu", entities_size));
+// Ticks the range_index'th of worker_count roughly equal ranges of all tick group members
+static void tick_range(size_t range_index, size_t ticked_count) {
+	size_t start = range_index * ticked_count / worker_count;
+	size_t end = (range_index + 1) * ticked_count / worker_count;
 
-	draw_debug_line_left(TextFormat("drawn entities: %zu", drawn_entities));
+	tick_buffer = &tick_buffers[range_index];
 
-	draw_debug_line_left(TextFormat("grug mode: %s", grug_are_on_fns_in_safe_mode() ? "safe" : "fast"));
+	size_t group_start = 0;
+	for (size_t group_index = 0; group_index < tick_groups_size && group_start < end; group_index++) {
+		struct tick_group *group = &tick_groups[group_index];
+		size_t group_end = group_start + group->size;
 
-	debug_line_number = 0;
+		size_t first = start > group_start ? start - group_start : 0;
+		size_t last = end < group_end ? end - group_start : group->size;
 
-	draw_debug_line_right(TextFormat("%.2f ms/frame", get_elapsed_ms(measurements[0].time, measurements[measurements_size - 1].time)));
+		long long start_ns = get_monotonic_ns();
+		for (size_t i = first; i < last; i++) {
+			tick_buffer->entity_commands_start = tick_buffer->commands_size;
+			group->tick(group->globals[i]);
+		}
+		if (first < last) {
+			add_mod_cost(group->mod_cost, last - first, get_monotonic_ns() - start_ns);
+		}
 
-	for (size_t i = 1; i < measurements_size - 1; i++) {
-		struct timespec previous = measurements[i - 1].time;
-		struct timespec current = measurements[i].time;
-		draw_debug_line_right(TextFormat("%.2f %s", get_elapsed_ms(previous, current), measurements[i].description));
+		group_start = group_end;
 	}
+
+	tick_buffer = NULL;
 }
 
-static Vector2 world_to_screen(b2Vec2 p) {
-	return (Vector2){
-		  p.x * TEXTURE_SCALE + SCREEN_WIDTH  / 2.0f,
-		- p.y * TEXTURE_SCALE + SCREEN_HEIGHT / 2.0f
-	};
+static void run_tick_ranges(int start, int end, u32 worker_index, void *context) {
+	(void)worker_index;
+
+	size_t ticked_count = *(size_t *)context;
+
+	for (int range_index = start; range_index < end; range_index++) {
+		tick_range(range_index, ticked_count);
+	}
 }
 
-static void draw_entity(struct entity entity) {
-	Texture texture = entity.texture;
+// Applies the game function calls of a parallel tick, in range order
+static void merge_tick_buffers(void) {
+	for (size_t range_index = 0; range_index < worker_count; range_index++) {
+		struct tick_buffer *buffer = &tick_buffers[range_index];
+
+		for (size_t i = 0; i < buffer->commands_size; i++) {
+			struct tick_command *command = &buffer->commands[i];
+
+			switch (command->type) {
+				case TICK_COMMAND_SPAWN: {
+					struct tick_spawn spawn = command->spawn;
+					if (create_entity_in_slot(spawn.slot_index, spawn.type, spawn.file)) {
+						push_spawn_command(spawn.command);
+					}
+					break;
+				}
+				case TICK_COMMAND_MAP_SET_I32:
+					game_fn_map_set_i32(command->map_set_i32.id, command->map_set_i32.key, command->map_set_i32.value);
+					break;
+				case TICK_COMMAND_PLAY_SOUND:
+					game_fn_play_sound(command->sound_path);
+					break;
+				case TICK_COMMAND_DESPAWN:
+					queue_despawn(command->despawn_id);
+					break;
+				case TICK_COMMAND_MESSAGE:
+					snprintf(message, sizeof(message), "%s", command->message);
+					add_message();
+					counted_free(command->message);
+					break;
+			}
+		}
 
-	b2Vec2 local_point = {
-		-texture.width / 2.0f,
-		texture.height / 2.0f
-	};
+		buffer->commands_size = 0;
 
-	// Rotates the local_point argument by the entity's angle
-	b2Vec2 pos_world = b2Body_GetWorldPoint(entity.body_id, local_point);
+		for (size_t i = buffer->reserved_slots_size; i > buffer->used_reserved_slots; i--) {
+			release_reserved_entity_slot(buffer->reserved_slots[i - 1]);
+		}
+	}
+}
 
-	Vector2 pos_screen = world_to_screen(pos_world);
+// The slots are reserved up front, so spawning doesn't have to grow entity_slots[] from several threads
+static void reserve_tick_slots(void) {
+	for (size_t range_index = 0; range_index < worker_count; range_index++) {
+		struct tick_buffer *buffer = &tick_buffers[range_index];
 
-	// Using this would be more accurate for huge textures, but would probably be slower
-	// b2AABB aabb = b2Body_ComputeAABB(entity.body_id);
-	// Vector2 lower = world_to_screen(aabb.lowerBound);
-	// Vector2 upper = world_to_screen(aabb.upperBound);
+		buffer->reserved_slots_size = 0;
+		buffer->used_reserved_slots = 0;
 
-	float margin = -2.0f * PIXELS_PER_METER;
-	float left = pos_screen.x + margin;
-	float right = pos_screen.x - margin;
-	float top = pos_screen.y + margin;
-	float bottom = pos_screen.y - margin;
-	if (left > SCREEN_WIDTH || right < 0 || top > SCREEN_HEIGHT || bottom < 0) {
-		return;
+		while (buffer->reserved_slots_size < RESERVED_SLOTS_PER_TICK_RANGE) {
+			u32 slot_index = allocate_entity_slot();
+			if (slot_index == UINT32_MAX) {
+				break;
+			}
+			buffer->reserved_slots[buffer->reserved_slots_size++] = slot_index;
+		}
+
+		buffer->rand_seed = rand();
 	}
+}
 
-	b2Rot rot = b2Body_GetRotation(entity.body_id);
-	float angle = b2Rot_GetAngle(rot);
+// Game functions don't touch shared state while this runs,
+// since they write to the tick buffer of the range they're called from
+// This relies on grug's fast mode, since safe mode tracks the running on_fn in globals
+static void tick_entities_in_parallel(void) {
+	size_t ticked_count = 0;
+	for (size_t group_index = 0; group_index < tick_groups_size; group_index++) {
+		ticked_count += tick_groups[group_index].size;
+	}
 
-	bool facing_left = (angle > PI / 2) || (angle < -PI / 2);
-    Rectangle source = { 0.0f, 0.0f, (float)texture.width, (float)texture.height * (entity.flippable && facing_left ? -1 : 1) };
-    Rectangle dest = { pos_screen.x, pos_screen.y, (float)texture.width*TEXTURE_SCALE, (float)texture.height*TEXTURE_SCALE };
-    Vector2 origin = { 0.0f, 0.0f };
-	float rotation = -angle * RAD2DEG;
-	DrawTexturePro(texture, source, dest, origin, rotation, WHITE);
+	reserve_tick_slots();
 
-	if (draw_bounding_box) {
-		Rectangle rect = {pos_screen.x, pos_screen.y, texture.width * TEXTURE_SCALE, texture.height * TEXTURE_SCALE};
-		Color color = {.r=42, .g=42, .b=242, .a=100};
-		DrawRectanglePro(rect, origin, -angle * RAD2DEG, color);
+	tasks_size = 0;
+
+	long long start_ns = get_monotonic_ns();
+	void *task = enqueue_task(run_tick_ranges, worker_count, 1, &ticked_count, &parallel_tick_task_marker);
+	if (task) {
+		finish_task(task, NULL);
 	}
+	parallel_tick_ns += get_monotonic_ns() - start_ns;
+	record("calling bullets and counters their on_tick() in parallel");
 
-	drawn_entities++;
+	merge_tick_buffers();
+	record("merging tick buffers");
 }
 
-static void record(char *description) {
-	if (debug_info) {
-		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &measurements[measurements_size].time);
-		measurements[measurements_size++].description = description;
+// Entities spawned by on_tick() are only added to a group by apply_commands(),
+// so the groups don't change while they're being iterated
+static void tick_entities(void) {
+	begin_zone("tick_entities");
+
+	if (parallel_ticks && !grug_are_on_fns_in_safe_mode() && worker_count > 1) {
+		tick_entities_in_parallel();
+	} else {
+		for (size_t group_index = 0; group_index < tick_groups_size; group_index++) {
+			struct tick_group *group = &tick_groups[group_index];
+
+			// Timing the group as a whole keeps the clock reads out of the per-entity loop
+			long long start_ns = get_monotonic_ns();
+			for (size_t i = 0; i < group->size; i++) {
+				group->tick(group->globals[i]);
+			}
+			add_mod_cost(group->mod_cost, group->size, get_monotonic_ns() - start_ns);
+		}
+		record("calling bullets and counters their on_tick()");
 	}
+
+	apply_commands();
+	record("applying commands");
+
+	end_zone();
 }
 
-static void draw(void) {
-	BeginDrawing();
-	record("beginning drawing");
+struct watched_dir {
+	int wd;
+	char path[STUPID_MAX_PATH];
+};
 
-	DrawTextureEx(background_texture, Vector2Zero(), 0, 2, WHITE);
-	record("drawing background");
+// Written by the main thread before the watcher starts, and afterwards only by the watcher
+static struct watched_dir watched_dirs[MAX_WATCHED_DIRS];
+static size_t watched_dirs_size;
 
-	drawn_entities = 0;
-	for (size_t i = 0; i < entities_size; i++) {
-		struct entity entity = entities[i];
+static int inotify_fd = -1;
+static pthread_t mod_watcher;
 
-		if (entity.texture.id > 0) {
-			draw_entity(entity);
-		}
+// Set by the watcher once the mods changed and then stayed untouched for MOD_WATCH_QUIET_MS,
+// so that update() only has to do a single atomic load when nothing changed
+// It starts out set, so the first frame loads the mods
+static atomic_bool mods_dirty = true;
+
+// Cleared when the watcher can't do its job, after which the mods get checked every frame again
+static atomic_bool mods_watched;
+
+// Only close-write and moves count as file changes, so half-written files are ignored
+#define MOD_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_DELETE_SELF)
+
+// Returns whether watching the directory and all its subdirectories failed
+static bool watch_dir(char *path) {
+	if (watched_dirs_size >= MAX_WATCHED_DIRS) {
+		fprintf(stderr, "There are more than %d mod directories, exceeding MAX_WATCHED_DIRS\n", MAX_WATCHED_DIRS);
+		return true;
 	}
-	record("drawing entities");
 
-	// Color red = {.r=242, .g=42, .b=42, .a=255};
-	// DrawLine(gun_screen_pos.x, gun_screen_pos.y, mouse_pos.x, mouse_pos.y, red);
-	// record("drawing gun line");
+	int wd = inotify_add_watch(inotify_fd, path, MOD_WATCH_MASK);
+	if (wd == -1) {
+		perror("inotify_add_watch");
+		return true;
+	}
 
-	struct timespec current_time;
-	clock_gettime(CLOCK_MONOTONIC, &current_time);
+	struct watched_dir *watched = &watched_dirs[watched_dirs_size++];
+	watched->wd = wd;
+	snprintf(watched->path, sizeof(watched->path), "%s", path);
 
-	size_t i = 0;
-	size_t start = messages_start;
-	size_t size = messages_size;
-	while (i < size) {
-		double elapsed_ms = get_elapsed_ms(messages[(start + i) % MAX_MESSAGES].time, current_time);
-		if (elapsed_ms < ERROR_MESSAGE_DURATION_MS) {
-			break;
+	DIR *dir = opendir(path);
+	if (!dir) {
+		perror("opendir");
+		return true;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) {
+			continue;
 		}
 
-		// Remove the old error message
-		messages_start = (messages_start + 1) % MAX_MESSAGES;
-		messages_size--;
+		char child_path[STUPID_MAX_PATH];
+		snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
 
-		i++;
+		struct stat child_stat;
+		if (stat(child_path, &child_stat) == 0 && S_ISDIR(child_stat.st_mode) && watch_dir(child_path)) {
+			closedir(dir);
+			return true;
+		}
 	}
-	record("clearing old error messages");
 
-	for (i = 0; i < messages_size; i++) {
-		Color color = RAYWHITE;
+	closedir(dir);
 
-		double elapsed_ms = get_elapsed_ms(messages[(messages_start + i) % MAX_MESSAGES].time, current_time);
-		if (elapsed_ms > ERROR_MESSAGE_FADING_MOMENT_MS) {
-			double alpha = 255.0 * (ERROR_MESSAGE_DURATION_MS - elapsed_ms) / (double)(ERROR_MESSAGE_DURATION_MS - ERROR_MESSAGE_FADING_MOMENT_MS);
-			if (alpha < 0.0) {
-				alpha = 0.0;
-			}
-			assert(alpha >= 0.0 && alpha <= 255.0);
-			color.a = alpha;
+	return false;
+}
+
+static char *get_watched_dir_path(int wd) {
+	for (size_t i = 0; i < watched_dirs_size; i++) {
+		if (watched_dirs[i].wd == wd) {
+			return watched_dirs[i].path;
+		}
+	}
+	return NULL;
+}
+
+// Returns whether the events mean that the mods need to be regenerated,
+// or sets watcher_failed when a new directory couldn't be watched
+static bool handle_mod_events(char *buffer, ssize_t length, bool *watcher_failed) {
+	bool changed = false;
+
+	for (char *p = buffer; p < buffer + length;) {
+		struct inotify_event *event = (struct inotify_event *)p;
+		p += sizeof(*event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			changed = true;
+			continue;
 		}
 
-		DrawText(messages[(messages_start + i) % MAX_MESSAGES].message, 0, SCREEN_HEIGHT - FONT_SIZE * (messages_size - i), FONT_SIZE, color);
-	}
-	record("drawing error message");
+		// A file only counts as changed once it's been closed, and not when it's created
+		if ((event->mask & IN_CREATE) && !(event->mask & IN_ISDIR)) {
+			continue;
+		}
 
-	record("end");
+		changed = true;
 
-	if (debug_info) {
-		draw_debug_info();
+		char *dir_path = get_watched_dir_path(event->wd);
+
+		if (dir_path && event->len > 0) {
+			char path[STUPID_MAX_PATH];
+			snprintf(path, sizeof(path), "%s/%s", dir_path, event->name);
+			fprintf(stderr, "Detected a change to %s\n", path);
+
+			// New directories need watching too
+			if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && watch_dir(path)) {
+				*watcher_failed = true;
+			}
+		}
 	}
 
-	EndDrawing();
+	return changed;
 }
 
-static void play_collision_sound(b2ContactHitEvent *event) {
-	// printf("approachSpeed: %f\n", event->approachSpeed);
+static void *run_mod_watcher(void *arg) {
+	(void)arg;
 
-	float x_normalized = (event->point.x * TEXTURE_SCALE) / (SCREEN_WIDTH / 2); // Between -1.0f and 1.0f
-	// printf("x_normalized: %f\n", x_normalized);
+	// Aligned, since inotify_event structs are read straight out of it
+	_Alignas(struct inotify_event) char buffer[4096];
 
-	float y_normalized = (event->point.y * TEXTURE_SCALE) / (SCREEN_HEIGHT / 2); // Between -1.0f and 1.0f
-	// printf("y_normalized: %f\n", y_normalized);
+	bool watcher_failed = false;
 
-	float distance = sqrtf(x_normalized * x_normalized + y_normalized * y_normalized);
-	// printf("distance: %f\n", distance);
+	while (!watcher_failed) {
+		ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			perror("read");
+			break;
+		}
 
-	float audibility = 1.0f;
-	if (distance > 0.0f) { // Prevents a later division by 0.0f
-		distance *= 5.0f;
+		if (!handle_mod_events(buffer, length, &watcher_failed)) {
+			continue;
+		}
 
-		// This considers the game to be a 3D space
-		// See https://en.wikipedia.org/wiki/Inverse-square_law
-		audibility = 1.0f / (distance * distance); // Between 0.0f and 1.0f
+		// Debounces bursts of writes, like an editor saving several files, into a single regeneration
+		struct pollfd pollfd = {.fd = inotify_fd, .events = POLLIN};
+		while (poll(&pollfd, 1, MOD_WATCH_QUIET_MS) > 0) {
+			length = read(inotify_fd, buffer, sizeof(buffer));
+			if (length <= 0) {
+				perror("read");
+				watcher_failed = true;
+				break;
+			}
 
-		// This considers the game to be a 2D space
-		// audibility = 1.0f / distance; // Between 0.0f and 1.0f
+			handle_mod_events(buffer, length, &watcher_failed);
+		}
 
-		assert(audibility >= 0.0f);
+		atomic_store(&mods_dirty, true);
 	}
-	// printf("audibility: %f\n", audibility);
 
-	float volume = event->approachSpeed * 0.01f;
+	fprintf(stderr, "The mod watcher stopped, so the mods are checked every frame again\n");
+	atomic_store(&mods_watched, false);
 
-	volume *= audibility;
+	return NULL;
+}
 
-	if (volume > 1.0f) {
-		volume = 1.0f;
-	}
-	if (volume < 0.01f) {
+// Falls back to checking the mods every frame if they can't be watched
+static void start_mod_watcher(char *mods_dir_path) {
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		perror("inotify_init1");
 		return;
 	}
 
-	Sound sound;
-	if (rand() % 2 == 0 && sound_cooldown_metal_blunt_1 == 0) {
-		sound = metal_blunt_1;
-		sound_cooldown_metal_blunt_1 = 6;
-		// sound_volume_metal_blunt_1 = ;
-	} else if (sound_cooldown_metal_blunt_2 == 0) {
-		sound = metal_blunt_2;
-		sound_cooldown_metal_blunt_2 = 6;
-		// sound_volume_metal_blunt_2 = ;
-	} else {
+	if (watch_dir(mods_dir_path)) {
+		close(inotify_fd);
 		return;
 	}
 
-	SetSoundVolume(sound, volume);
+	atomic_store(&mods_watched, true);
 
-	float speed = event->approachSpeed * 0.005f;
-	// printf("speed: %f\n", speed);
-	float min_pitch = 0.5f;
-	float max_pitch = 1.5f;
-	float pitch = min_pitch + speed;
-	// printf("pitch: %f\n", pitch);
-	if (pitch > max_pitch) {
-		pitch = max_pitch;
+	if (pthread_create(&mod_watcher, NULL, run_mod_watcher, NULL)) {
+		fprintf(stderr, "pthread_create() failed\n");
+		exit(EXIT_FAILURE);
 	}
-	SetSoundPitch(sound, pitch);
 
-	float x_normalized_inverted = -x_normalized; // Because a pan of 1.0f means all the way left, instead of right
-	float pan = 0.5f + x_normalized_inverted / 2.0f; // Between 0.0f and 1.0f
-	// printf("pan: %f\n", pan);
-	SetSoundPan(sound, pan);
-
-	PlaySound(sound);
+	// It's blocked in read() until the process exits
+	pthread_detach(mod_watcher);
 }
 
-static void spawn_companion(char *name) {
-	struct grug_file *file = grug_get_entity_file(name);
+#ifdef HEADLESS
 
-	struct entity *entity = spawn_entity(OBJECT_BOX, file);
-	if (!entity) {
-		return;
-	}
+#define MAX_BENCH_PHASES 420
+#define MAX_BENCH_PHASE_PATH_LENGTH 420
 
-	b2BodyDef body_def = b2DefaultBodyDef();
-	body_def.type = b2_dynamicBody;
-	body_def.position = (b2Vec2){ 50.0f, 100.0f };
+// Keyed by the zone's path, like "tick_entities / applying commands",
+// since zones with the same name can be nested under different parents
+struct bench_phase {
+	// Interned, so it's compared by address
+	char *path;
 
-	add_body(entity, body_def, false, true);
-}
+	u32 depth;
 
-static struct entity *spawn_gun(struct grug_file *file, b2Vec2 pos) {
-	b2BodyDef body_def = b2DefaultBodyDef();
-	body_def.position = pos;
+	double total_ms;
 
-	struct entity *gun_entity = entities + entities_size;
+	// The total minus the time spent in child zones, so summing it over all phases doesn't count any time twice
+	double self_ms;
 
-	struct entity *entity = spawn_entity(OBJECT_GUN, file);
-	assert(entity); // spawn_gun() is only ever called once, which is at startup
+	double max_ms;
+	size_t count;
+};
 
-	add_body(entity, body_def, true, false);
+static struct bench_phase bench_phases[MAX_BENCH_PHASES];
+static size_t bench_phases_size;
 
-	spawn_companion(gun_on_spawn_data.companion);
+static struct bench_phase *add_bench_phase_measurement(char *path, u32 depth, double ms) {
+	struct bench_phase *phase = NULL;
+
+	for (size_t i = 0; i < bench_phases_size; i++) {
+		if (bench_phases[i].path == path) {
+			phase = &bench_phases[i];
+			break;
+		}
+	}
+
+	if (!phase) {
+		if (bench_phases_size >= MAX_BENCH_PHASES) {
+			fprintf(stderr, "There are more than %d phases, exceeding MAX_BENCH_PHASES\n", MAX_BENCH_PHASES);
+			exit(EXIT_FAILURE);
+		}
 
-	return gun_entity;
+		phase = &bench_phases[bench_phases_size++];
+		*phase = (struct bench_phase){.path = path, .depth = depth};
+	}
+
+	phase->total_ms += ms;
+	phase->self_ms += ms;
+	if (ms > phase->max_ms) {
+		phase->max_ms = ms;
+	}
+	phase->count++;
+
+	return phase;
 }
 
-static void spawn_boxes(struct grug_file *file) {
-	int spawned_box_count = 160;
+// The first zone is the whole frame, which isn't a phase
+static void add_bench_phase_measurements(struct profiled_frame *profiled) {
+	char *names[MAX_ZONE_DEPTH + 1];
+	struct bench_phase *parents[MAX_ZONE_DEPTH + 1];
 
-	for (int i = 0; i < spawned_box_count; i++) {
-		struct entity *entity = spawn_entity(OBJECT_BOX, file);
-		if (!entity) {
-			break;
-		}
+	for (size_t i = 1; i < profiled->zones_size; i++) {
+		struct zone zone = profiled->zones[i];
+		double ms = zone.wall_ns / 1.0e6;
 
-		// Since the box may use a game fn to pick a random sprite_path,
-		// we load the texture of every individual box
-		Texture texture = LoadTexture(entity->box.sprite_path);
-		assert(texture.id > 0);
+		names[zone.depth] = zone.name;
 
-		b2BodyDef body_def = b2DefaultBodyDef();
-		body_def.type = b2_dynamicBody;
-		body_def.position = (b2Vec2){ -100.0f, (i - spawned_box_count / 2) * texture.height + 1000.0f };
+		char path[MAX_BENCH_PHASE_PATH_LENGTH];
+		size_t path_length = 0;
+		for (u32 depth = 1; depth <= zone.depth && path_length < sizeof(path); depth++) {
+			path_length += snprintf(path + path_length, sizeof(path) - path_length, "%s%s", depth > 1 ? " / " : "", names[depth]);
+		}
 
-		UnloadTexture(texture);
+		parents[zone.depth] = add_bench_phase_measurement(intern(path), zone.depth, ms);
 
-		add_body(entity, body_def, false, true);
+		if (zone.depth > 1) {
+			parents[zone.depth - 1]->self_ms -= ms;
+		}
 	}
 }
 
-static void spawn_ground(struct grug_file *file) {
-	int ground_entity_count = 16;
+static void print_bench_results(size_t frames, float delta_time, double total_ms) {
+	printf("{\n");
+	printf("\t\"frames\": %zu,\n", frames);
+	printf("\t\"delta_time\": %f,\n", delta_time);
+	printf("\t\"entities\": %zu,\n", entities_size);
+	printf("\t\"total_ms\": %f,\n", total_ms);
+	printf("\t\"mean_frame_ms\": %f,\n", total_ms / frames);
+	printf("\t\"workers\": [");
+	for (size_t i = 0; i < worker_count; i++) {
+		printf("%s%f", i > 0 ? ", " : "", get_worker_utilization(i));
+	}
+	printf("],\n");
+	printf("\t\"tick_workers\": [");
+	for (size_t i = 0; i < worker_count; i++) {
+		printf("%s%f", i > 0 ? ", " : "", get_worker_tick_utilization(i));
+	}
+	printf("],\n");
+	printf("\t\"mods\": [\n");
 
-	for (int i = 0; i < ground_entity_count; i++) {
-		struct entity *entity = spawn_entity(OBJECT_BOX, file);
-		if (!entity) {
-			break;
-		}
+	for (size_t i = 0; i < mod_costs_size; i++) {
+		struct mod_cost *cost = &mod_costs[i];
 
-		// Since the box may use a game fn to pick a random sprite_path,
-		// we load the texture of every individual box
-		Texture texture = LoadTexture(entity->box.sprite_path);
-		assert(texture.id > 0);
+		printf("\t\t{\"entity\": \"%s\", \"file\": \"%s\", \"total_ms\": %f, \"safe_calls\": %lld, \"safe_us_per_call\": %f, \"fast_calls\": %lld, \"fast_us_per_call\": %f}%s\n", cost->entity, cost->file_name, get_mod_cost_total_ns(cost) / 1.0e6, atomic_load(&cost->calls[1]), get_mod_cost_us_per_call(cost, 1), atomic_load(&cost->calls[0]), get_mod_cost_us_per_call(cost, 0), i + 1 < mod_costs_size ? "," : "");
+	}
 
-		b2BodyDef body_def = b2DefaultBodyDef();
-		body_def.position = (b2Vec2){ (i - ground_entity_count / 2) * texture.width, -100.0f };
+	printf("\t],\n");
+	printf("\t\"memory\": [\n");
 
-		UnloadTexture(texture);
+	for (size_t i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++) {
+		struct memory_usage *usage = &memory_usages[i];
 
-		add_body(entity, body_def, false, false);
+		printf("\t\t{\"subsystem\": \"%s\", \"current_bytes\": %lld, \"peak_bytes\": %lld, \"allocations\": %lld}%s\n", memory_subsystem_names[i], atomic_load(&usage->current_bytes), atomic_load(&usage->peak_bytes), atomic_load(&usage->allocations), i + 1 < MEMORY_SUBSYSTEM_COUNT ? "," : "");
+	}
+
+	printf("\t],\n");
+	printf("\t\"phases\": [\n");
+
+	for (size_t i = 0; i < bench_phases_size; i++) {
+		struct bench_phase phase = bench_phases[i];
+
+		printf("\t\t{\"path\": \"%s\", \"depth\": %u, \"count\": %zu, \"total_ms\": %f, \"self_ms\": %f, \"mean_ms\": %f, \"max_ms\": %f}%s\n", phase.path, phase.depth, phase.count, phase.total_ms, phase.self_ms, phase.total_ms / phase.count, phase.max_ms, i + 1 < bench_phases_size ? "," : "");
 	}
+
+	printf("\t]\n");
+	printf("}\n");
 }
 
-static void push_file_containing_fn(struct grug_file *file) {
-	if (type_files_size + 1 > MAX_TYPE_FILES) {
-		fprintf(stderr, "There are more than %d files containing the requested type, exceeding MAX_TYPE_FILES", MAX_TYPE_FILES);
+static struct grug_file *get_named_type_file(char *entity_type, char *entity) {
+	size_t files_size;
+	struct grug_file **files = get_type_files(entity_type, &files_size);
+
+	if (files_size == 0) {
+		fprintf(stderr, "There are no '%s' entities\n", entity_type);
 		exit(EXIT_FAILURE);
 	}
-	type_files[type_files_size++] = file;
-}
 
-static void update_type_files_impl(struct grug_mod_dir dir, char *entity_type) {
-	for (size_t i = 0; i < dir.dirs_size; i++) {
-		update_type_files_impl(dir.dirs[i], entity_type);
+	if (!entity) {
+		return files[0];
 	}
 
-	for (size_t i = 0; i < dir.files_size; i++) {
-		if (streq(entity_type, dir.files[i].entity_type)) {
-			push_file_containing_fn(&dir.files[i]);
+	for (size_t i = 0; i < files_size; i++) {
+		if (streq(files[i]->entity, entity)) {
+			return files[i];
 		}
 	}
-}
 
-static struct grug_file **get_type_files(char *entity_type) {
-	type_files_size = 0;
-	update_type_files_impl(grug_mods, entity_type);
-	return type_files;
+	fprintf(stderr, "There is no '%s' entity called '%s'\n", entity_type, entity);
+	exit(EXIT_FAILURE);
 }
 
-static void reload_entity_shape(struct entity *entity, char *texture_path) {
-	printf("Reloading entity shape %s\n", texture_path);
+static void runtime_error_handler(char *reason, enum grug_runtime_error_type type, char *on_fn_name, char *on_fn_path) {
+	(void)type;
 
-	UnloadTexture(entity->texture);
+	fprintf(stderr, "grug runtime error in %s(): %s, in %s\n", on_fn_name, reason, on_fn_path);
+}
 
-	// Retrying this in a loop is necessary for GIMP,
-	// since it doesn't write all bytes at once,
-	// causing LoadTexture() to sporadically fail
-	size_t attempts = 0;
-	do {
-		entity->texture = LoadTexture(texture_path);
-		attempts++;
-	} while (entity->texture.id == 0);
-	printf("The reloaded entity's new texture took %zu attempt%s to load succesfully\n", attempts, attempts == 1 ? "" : "s");
+// raylib logs to stdout by default, where it would end up in the middle of the JSON
+static void log_to_stderr(int log_level, const char *text, va_list args) {
+	(void)log_level;
 
-	free(entity->texture_path);
-	entity->texture_path = strdup(texture_path);
+	vfprintf(stderr, text, args);
+	fprintf(stderr, "\n");
+}
 
-	b2DestroyShape(entity->shape_id, true);
-	entity->shape_id = add_shape(entity->body_id, entity->texture, entity->enable_hit_events, entity->type == OBJECT_BULLET ? entity->bullet.density : 1.0f);
+static void print_usage(char *program) {
+	fprintf(stderr, "Usage: %s [--frames n] [--delta-time seconds] [--crates n] [--bullets n] [--gun entity] [--bullet entity] [--fire-every-n-frames n] [--max-entities n] [--workers n] [--parallel-ticks 0|1] [--poll-mods 0|1] [--seed n]\n", program);
 }
 
-static void reload_entity(struct entity *entity, struct grug_file *file) {
-	call_on_despawn(entity, entity->on_fns);
+// Runs the entity, grug and Box2D pipeline of the game without a window, audio or drawing,
+// using a fixed delta time, and prints the time spent in every record() phase as JSON
+int main(int argc, char *argv[]) {
+	size_t frame_count = 1000;
+	float delta_time = SECONDS_PER_TICK;
+	int crate_count = 160;
+	int bullet_count = 0;
+	char *gun_entity = NULL;
+	char *bullet_entity = NULL;
 
-	entity->dll = file->dll;
+	// 0 means that the gun fires as fast as its rounds per minute allows
+	size_t fire_every_n_frames = 0;
 
-	free(entity->globals);
-	entity->globals = malloc(file->globals_size);
-	file->init_globals_fn(entity->globals, entity->id);
+	unsigned int seed = 42;
 
-	entity->on_fns = file->on_fns;
+	// 0 means one worker per CPU core
+	size_t requested_worker_count = 0;
 
-	if (call_on_spawn(entity, file->on_fns)) {
-		return;
+	// By default the mods are only regenerated when the watcher saw them change, like in the game
+	bool poll_mods = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		char *option = argv[i];
+		char *value = argv[++i];
+
+		if (streq(option, "--frames")) {
+			frame_count = strtoul(value, NULL, 10);
+		} else if (streq(option, "--delta-time")) {
+			delta_time = strtof(value, NULL);
+		} else if (streq(option, "--crates")) {
+			crate_count = atoi(value);
+		} else if (streq(option, "--bullets")) {
+			bullet_count = atoi(value);
+		} else if (streq(option, "--gun")) {
+			gun_entity = value;
+		} else if (streq(option, "--bullet")) {
+			bullet_entity = value;
+		} else if (streq(option, "--fire-every-n-frames")) {
+			fire_every_n_frames = strtoul(value, NULL, 10);
+		} else if (streq(option, "--max-entities")) {
+			max_entities = strtoul(value, NULL, 10);
+		} else if (streq(option, "--workers")) {
+			requested_worker_count = strtoul(value, NULL, 10);
+		} else if (streq(option, "--parallel-ticks")) {
+			parallel_ticks = atoi(value) != 0;
+		} else if (streq(option, "--poll-mods")) {
+			poll_mods = atoi(value) != 0;
+		} else if (streq(option, "--seed")) {
+			seed = strtoul(value, NULL, 10);
+		} else {
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
 	}
 
-	write_on_spawn_data_to_entity(entity);
+	if (frame_count == 0 || delta_time <= 0.0f) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	srand(seed);
 
-	char *texture_path = get_texture_path(entity);
+	// stdout only gets the JSON, so everything else is logged to stderr
+	SetTraceLogLevel(LOG_WARNING);
+	SetTraceLogCallback(log_to_stderr);
 
-	if (texture_path) {
-		reload_entity_shape(entity, texture_path);
+	if (grug_init(runtime_error_handler, "mod_api.json", "mods")) {
+		fprintf(stderr, "grug_init() error: %s (detected by grug.c:%d)\n", grug_error.msg, grug_error.grug_c_line_number);
+		return EXIT_FAILURE;
 	}
-}
 
-static void reload_gun(struct grug_file *gun_file) {
-	reload_entity(gun, gun_file);
-	spawn_companion(gun_on_spawn_data.companion);
-}
+	start_workers(requested_worker_count);
+	start_texture_decoders();
 
-static void reload_modified_resources(void) {
-	for (size_t i = 0; i < grug_resource_reloads_size; i++) {
-		struct grug_modified_resource reload = grug_resource_reloads[i];
+	// Parallel ticks need grug's fast mode
+	if (parallel_ticks && grug_are_on_fns_in_safe_mode()) {
+		grug_toggle_on_fns_mode();
+	}
 
-		printf("Reloading resource %s\n", reload.path);
+	world_id = create_world();
 
-		for (size_t entity_index = 0; entity_index < entities_size; entity_index++) {
-			struct entity *entity = &entities[entity_index];
+	memset(texture_buckets, 0xff, sizeof(texture_buckets));
+	memset(sound_buckets, 0xff, sizeof(sound_buckets));
 
-			if (entity->texture_path && streq(entity->texture_path, reload.path)) {
-				reload_entity_shape(entity, reload.path);
-			}
-		}
+	metal_blunt_1 = load_sound("MetalBlunt1.wav");
+	metal_blunt_2 = load_sound("MetalBlunt2.wav");
+
+	if (!poll_mods) {
+		start_mod_watcher("mods");
 	}
-}
 
-static void reload_modified_entities(void) {
-	for (size_t i = 0; i < grug_reloads_size; i++) {
-		struct grug_modified reload = grug_reloads[i];
+	// The mods are loaded right below, so the watcher only needs to report changes made after this
+	atomic_store(&mods_dirty, false);
 
-		printf("Reloading %s\n", reload.path);
+	if (regenerate_modified_mods()) {
+		fprintf(stderr, "%s", message);
+		return EXIT_FAILURE;
+	}
 
-		for (size_t entity_index = 0; entity_index < entities_size; entity_index++) {
-			struct entity *entity = &entities[entity_index];
+	struct grug_file *gun_file = get_named_type_file("gun", gun_entity);
 
-			if (reload.old_dll == entity->dll) {
-				reload_entity(entity, &reload.file);
-			}
+	struct grug_file *bullet_file = bullet_count > 0 ? get_named_type_file("bullet", bullet_entity) : NULL;
+
+	struct grug_file *concrete_file = get_box_file("vanilla:concrete");
+	assert(concrete_file && "Expected 'vanilla:concrete' to be present, for forming the ground");
+
+	struct grug_file *crate_file = get_box_file("vanilla:crate");
+	assert(crate_file && "Expected 'vanilla:crate' to be present, for having crates that fall down");
+
+	spawn_initial_entities(gun_file, concrete_file, crate_file, crate_count);
+
+	for (int i = 0; i < bullet_count; i++) {
+		game_fn_spawn_bullet(bullet_file->entity, 0.0f, 0.0f, game_fn_rand(-45.0f, 45.0f), game_fn_rand(10.0f, 100.0f));
+	}
+	apply_commands();
+
+	reset_worker_utilization();
+
+	double ms_since_round_fired = 0.0;
+
+	double total_ms = 0.0;
+
+	for (size_t frame = 0; frame < frame_count; frame++) {
+		begin_frame();
+
+		bool mods_changed = poll_mods || atomic_exchange(&mods_dirty, false) || !atomic_load(&mods_watched);
+
+		if (mods_changed && regenerate_modified_mods()) {
+			fprintf(stderr, "%s", message);
+			return EXIT_FAILURE;
+		}
+
+		upload_decoded_textures();
+
+		step_world(delta_time);
+
+		ms_since_round_fired += delta_time * 1000.0;
+
+		bool can_fire;
+		if (fire_every_n_frames > 0) {
+			can_fire = frame % fire_every_n_frames == 0;
+		} else {
+			can_fire = ms_since_round_fired > get_cold(gun)->gun.ms_per_round_fired;
 		}
+		if (can_fire) {
+			ms_since_round_fired = 0.0;
+			fire_gun();
+		}
+
+		tick_entities();
+
+		struct profiled_frame *profiled = end_frame();
+
+		add_bench_phase_measurements(profiled);
+
+		total_ms += profiled->zones[0].wall_ns / 1.0e6;
 	}
+
+	print_bench_results(frame_count, delta_time, total_ms);
+
+	b2DestroyWorld(world_id);
+	stop_workers();
+	stop_texture_decoders();
+}
+
+#else
+
+static void reload_gun(struct grug_file *gun_file) {
+	reload_entity(gun, gun_file);
+	spawn_companion(gun_on_spawn_data.companion);
+	apply_commands();
 }
 
 static void update(struct timespec *previous_round_fired_time) {
-	measurements_size = 0;
-	record("start");
+	static bool initialized = false;
 
-	if (grug_regenerate_modified_mods()) {
-		if (grug_loading_error_in_grug_file) {
-			snprintf(message, sizeof(message), "grug loading error: %s, in %s (detected by grug.c:%d)\n", grug_error.msg, grug_error.path, grug_error.grug_c_line_number);
-		} else {
-			snprintf(message, sizeof(message), "grug loading error: %s (detected by grug.c:%d)\n", grug_error.msg, grug_error.grug_c_line_number);
-		}
-		add_message();
+	bool mods_changed = atomic_exchange(&mods_dirty, false) || !atomic_load(&mods_watched);
+
+	// Once the game is running, a mod with an error doesn't stop it,
+	// and it's only retried after the watcher sees the mods change again
+	// Before that there is no old code to keep running, so it keeps retrying every frame
+	if (mods_changed && regenerate_modified_mods() && !initialized) {
+		atomic_store(&mods_dirty, true);
 
 		draw();
 
@@ -1144,66 +5203,42 @@ static void update(struct timespec *previous_round_fired_time) {
 
 		return;
 	}
-	record("mod regeneration");
-
-	reload_modified_entities();
-	record("reloading entities");
 
-	reload_modified_resources();
-	record("reloading resources");
+	upload_decoded_textures();
 
 	static size_t gun_index = 0;
 
-	struct grug_file *gun_file = get_type_files("gun")[gun_index];
-	size_t gun_count = type_files_size;
+	size_t gun_count;
+	struct grug_file **gun_files = get_type_files("gun", &gun_count);
+	assert(gun_count > 0 && "Expected at least one gun");
 
-	struct grug_file **box_files = get_type_files("box");
+	// A regenerated mod can have removed a gun
+	gun_index %= gun_count;
+	struct grug_file *gun_file = gun_files[gun_index];
 
-	struct grug_file *concrete_file = NULL;
-	for (size_t i = 0; i < type_files_size; i++) {
-		struct grug_file *box_file = box_files[i];
-		if (streq(box_file->entity, "vanilla:concrete")) {
-			concrete_file = box_file;
-		}
-	}
+	struct grug_file *concrete_file = get_box_file("vanilla:concrete");
 	assert(concrete_file && "Expected 'vanilla:concrete' to be present, for forming the ground");
 
-	struct grug_file *crate_file = NULL;
-	for (size_t i = 0; i < type_files_size; i++) {
-		struct grug_file *box_file = box_files[i];
-		if (streq(box_file->entity, "vanilla:crate")) {
-			crate_file = box_file;
-		}
-	}
+	struct grug_file *crate_file = get_box_file("vanilla:crate");
 	assert(crate_file && "Expected 'vanilla:crate' to be present, for having crates that fall down");
 
-	static bool initialized = false;
 	if (!initialized) {
 		initialized = true;
 
-		b2Vec2 pos = { 100.0f, 0 };
-
-		gun = spawn_gun(gun_file, pos);
-
-		free(gun->globals);
-		gun->globals = malloc(gun_file->globals_size);
-		gun_file->init_globals_fn(gun->globals, gun->id);
-
-		spawn_ground(concrete_file);
-		spawn_boxes(crate_file);
+		spawn_initial_entities(gun_file, concrete_file, crate_file, SPAWNED_BOX_COUNT);
 	}
 
 	float mouse_movement = GetMouseWheelMove();
 	if (mouse_movement > 0) {
 		gun_index++;
 		gun_index %= gun_count;
-		gun_file = get_type_files("gun")[gun_index];
+		gun_file = gun_files[gun_index];
 		reload_gun(gun_file);
 	}
 	if (mouse_movement < 0) {
 		gun_index--;
 		gun_index %= gun_count;
-		gun_file = get_type_files("gun")[gun_index];
+		gun_file = gun_files[gun_index];
 		reload_gun(gun_file);
 	}
 
@@ -1212,12 +5247,13 @@ static void update(struct timespec *previous_round_fired_time) {
 	}
 	// Clear bullets and boxes
 	if (IsKeyPressed(KEY_C)) {
-		for (size_t i = entities_size; i > 0; i--) {
-			enum entity_type type = entities[i - 1].type;
+		for (size_t i = 0; i < entities_size; i++) {
+			enum entity_type type = entities[i].type;
 			if (type == OBJECT_BULLET || type == OBJECT_BOX) {
-				despawn_entity(i - 1);
+				queue_despawn(entities[i].id);
 			}
 		}
+		apply_commands();
 	}
 	// Toggle drawing and measuring debug info
 	if (IsKeyPressed(KEY_D)) {
@@ -1229,50 +5265,46 @@ static void update(struct timespec *previous_round_fired_time) {
 	if (IsKeyPressed(KEY_P)) {
 		paused = !paused;
 	}
+	// Export the profiled frames
+	if (IsKeyPressed(KEY_E)) {
+		dump_profile();
+		dump_mod_costs();
+		dump_memory();
+	}
+	// Toggle calling on_tick() on all workers
+	if (IsKeyPressed(KEY_T)) {
+		parallel_ticks = !parallel_ticks;
+	}
 	if (IsKeyPressed(KEY_S)) {
-		spawn_boxes(crate_file);
+		spawn_boxes(crate_file, SPAWNED_BOX_COUNT);
+		apply_commands();
 	}
 
 	if (!paused) {
-		float deltaTime = GetFrameTime();
-		b2World_Step(world_id, deltaTime, 4);
-		record("world step");
-
-		static bool out_of_bounds_entities[MAX_ENTITIES];
-		memset(out_of_bounds_entities, false, sizeof(out_of_bounds_entities));
-		record("clearing out_of_bounds_entities");
-
-		b2BodyEvents events = b2World_GetBodyEvents(world_id);
-		for (i32 i = 0; i < events.moveCount; i++) {
-			b2BodyMoveEvent *event = events.moveEvents + i;
-			// Remove entities that end up below the screen
-			if (event->transform.p.y < -SCREEN_HEIGHT / 2.0f / TEXTURE_SCALE - 100.0f) {
-				out_of_bounds_entities[(size_t)event->userData] = true;
-			}
-		}
-		record("getting body events");
+		static float accumulator = 0.0f;
 
-		if (sound_cooldown_metal_blunt_1 > 0) {
-			sound_cooldown_metal_blunt_1--;
-		}
-		if (sound_cooldown_metal_blunt_2 > 0) {
-			sound_cooldown_metal_blunt_2--;
+		float frame_seconds = GetFrameTime();
+		if (frame_seconds > MAX_FRAME_SECONDS) {
+			frame_seconds = MAX_FRAME_SECONDS;
 		}
-		b2ContactEvents contactEvents = b2World_GetContactEvents(world_id);
-		for (i32 i = 0; i < contactEvents.hitCount; i++) {
-			b2ContactHitEvent *event = &contactEvents.hitEvents[i];
-			// printf("Hit event!\n");
-			play_collision_sound(event);
-		}
-		record("collision handling");
+		accumulator += frame_seconds;
 
-		// This is O(n), but should be fast enough in practice
-		for (size_t i = entities_size; i > 0; i--) {
-			if (out_of_bounds_entities[i - 1]) {
-				despawn_entity(i - 1);
+		size_t ticks = 0;
+		while (accumulator >= SECONDS_PER_TICK) {
+			if (ticks >= MAX_TICKS_PER_FRAME) {
+				// Drops the ticks we can't catch up on, so the simulation slows down instead of freezing
+				accumulator = 0.0f;
+				break;
 			}
+
+			step_world(SECONDS_PER_TICK);
+			tick_entities();
+
+			accumulator -= SECONDS_PER_TICK;
+			ticks++;
 		}
-		record("removing entities");
+
+		interpolation_alpha = accumulator / SECONDS_PER_TICK;
 	}
 
 	Vector2 mouse_pos = GetMousePosition();
@@ -1286,36 +5318,15 @@ static void update(struct timespec *previous_round_fired_time) {
 	clock_gettime(CLOCK_MONOTONIC, &current_time);
 
 	double elapsed_ms = get_elapsed_ms(*previous_round_fired_time, current_time);
-	bool can_fire = elapsed_ms > gun->gun.ms_per_round_fired;
+	bool can_fire = elapsed_ms > get_cold(gun)->gun.ms_per_round_fired;
 	if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && can_fire) {
 		*previous_round_fired_time = current_time;
 
-		struct gun_on_fns *on_fns = gun->on_fns;
-		if (on_fns->fire) {
-			record("deciding whether to fire");
-			on_fns->fire(gun->globals);
-			record("calling the gun's on_fire()");
-		}
-	}
-
-	for (size_t entity_index = 0; entity_index < entities_size; entity_index++) {
-		struct entity *entity = &entities[entity_index];
-
-		if (entity->type == OBJECT_BULLET) {
-			struct bullet_on_fns *on_fns = entity->on_fns;
-			if (on_fns->tick) {
-				on_fns->tick(entity->globals);
-			}
-		} else if (entity->type == OBJECT_COUNTER) {
-			struct counter_on_fns *on_fns = entity->on_fns;
-			if (on_fns->tick) {
-				on_fns->tick(entity->globals);
-			}
-		}
+		fire_gun();
 	}
-	record("calling bullets and counters their on_tick()");
 
 	b2Body_SetTransform(gun->body_id, gun_world_pos, b2MakeRot(gun_angle));
+	snap_entity_transform(gun);
 	record("point gun to mouse");
 
 	draw();
@@ -1324,10 +5335,12 @@ static void update(struct timespec *previous_round_fired_time) {
 static void runtime_error_handler(char *reason, enum grug_runtime_error_type type, char *on_fn_name, char *on_fn_path) {
 	(void)type;
 
-	snprintf(message, sizeof(message), "grug runtime error in %s(): %s, in %s\n", on_fn_name, reason, on_fn_path);
-	add_message();
+	add_formatted_message("grug runtime error in %s(): %s, in %s\n", on_fn_name, reason, on_fn_path);
 
-	draw();
+	// Only the main thread can draw
+	if (!tick_buffer) {
+		draw();
+	}
 }
 
 int main(void) {
@@ -1338,40 +5351,57 @@ int main(void) {
 		return EXIT_FAILURE;
 	}
 
+	start_mod_watcher("mods");
+
 	SetConfigFlags(FLAG_VSYNC_HINT);
 	InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "box2d-raylib");
 
-	b2SetLengthUnitsPerMeter(PIXELS_PER_METER);
+	start_workers(0);
+	start_texture_decoders();
 
-	b2WorldDef world_def = b2DefaultWorldDef();
-	world_def.gravity.y = -9.8f * PIXELS_PER_METER;
-	// world_def.hitEventThreshold = 0.1f;
-	world_id = b2CreateWorld(&world_def);
+	world_id = create_world();
+
+	memset(texture_buckets, 0xff, sizeof(texture_buckets));
 
 	background_texture = LoadTexture("background.png");
 	assert(background_texture.id > 0);
 
 	InitAudioDevice();
 
-	metal_blunt_1 = LoadSound("MetalBlunt1.wav");
-	assert(metal_blunt_1.frameCount > 0);
-	metal_blunt_2 = LoadSound("MetalBlunt2.wav");
-	assert(metal_blunt_2.frameCount > 0);
+	memset(sound_buckets, 0xff, sizeof(sound_buckets));
+
+	metal_blunt_1 = load_sound("MetalBlunt1.wav");
+	metal_blunt_2 = load_sound("MetalBlunt2.wav");
 
 	struct timespec previous_round_fired_time;
 	clock_gettime(CLOCK_MONOTONIC, &previous_round_fired_time);
 
 	while (!WindowShouldClose()) {
+		// The frame is begun and ended out here, so update()'s early returns are profiled too
+		begin_frame();
 		update(&previous_round_fired_time);
+		end_frame();
 	}
 
 	// TODO: Are these necessary?
 	UnloadTexture(background_texture);
-	for (size_t i = 0; i < entities_size; i++) {
-		UnloadTexture(entities[i].texture);
+	for (size_t i = 0; i < textures_size; i++) {
+		if (textures[i].texture.id > 0) {
+			UnloadTexture(textures[i].texture);
+		}
+	}
+	for (size_t i = 0; i < sounds_size; i++) {
+		for (size_t voice_index = 0; voice_index < VOICES_PER_SOUND; voice_index++) {
+			UnloadSoundAlias(sounds[i].voices[voice_index]);
+		}
+		UnloadSound(sounds[i].sound);
 	}
-	UnloadSound(metal_blunt_1);
-	UnloadSound(metal_blunt_2);
 	CloseAudioDevice();
 	CloseWindow();
+
+	b2DestroyWorld(world_id);
+	stop_workers();
+	stop_texture_decoders();
 }
+
+#endif